@@ -1,31 +1,90 @@
 #define _GNU_SOURCE 1
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#include <nmmintrin.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#define HAVE_IO_URING 1
+// <linux/fs.h>, which io_uring.h pulls in, has a BLOCK_SIZE of its own
+#undef BLOCK_SIZE
+#endif
+#endif
+
 #define BLOCK_SIZE 1024
 #define BLOCKS_PER_FILE 1024
 
 #define MAX_FILE_LEN 64
-#define NUM_FILES 256
 
-#define FIRST_DATA_BLOCK 341
+// On-disk layout
+// Block 0 holds the superblock
+// Blocks 1-64 hold the free block map
+// Blocks 65-128 hold the inode map: the data block that stores each group
+// of INODES_PER_BLOCK inodes, so the inode table grows one block at a time
+// Blocks 129-384 hold a CRC32C checksum for every block of the image
+// Blocks 385-448 count how many snapshots refer to each block
+// Blocks 449-456 hold the snapshot table
+// The rest of the blocks are data blocks. Besides file data they hold
+// directories, indirect blocks and the inode table itself
+#define SUPERBLOCK 0
+#define FREE_BLOCK_MAP 1
+#define INODE_MAP 65
+#define CHECKSUM_TABLE 129
+#define SNAPSHOT_REFS 385
+#define SNAPSHOT_TABLE 449
+#define FIRST_DATA_BLOCK 457
+
+#define FS_MAGIC "MAV-FS"
+#define FS_VERSION 5
 
 #define DISK_IMAGE_SIZE 67108864
 #define NUM_BLOCKS (DISK_IMAGE_SIZE / BLOCK_SIZE)
 #define MAX_FILE_SIZE (BLOCK_SIZE * BLOCKS_PER_FILE)
-#define USABLE_SIZE ((NUM_BLOCKS - (FIRST_DATA_BLOCK - 1)) * 1024)
+#define USABLE_SIZE ((NUM_BLOCKS - FIRST_DATA_BLOCK) * BLOCK_SIZE)
+
+// The first NUM_DIRECT block numbers of a file live in its inode, the rest
+// in up to NUM_INDIRECT indirect blocks of PTRS_PER_BLOCK numbers each
+#define NUM_DIRECT 8
+#define NUM_INDIRECT 4
+#define PTRS_PER_BLOCK (BLOCK_SIZE / 4)
+
+#define INODES_PER_BLOCK 16
+#define MAX_INODES 262144
+#define DIRENTS_PER_BLOCK 13
+
+#define ROOT_INODE 0
 
-// No command has more than 5 arguments in our
+#define INODE_FILE 0
+#define INODE_DIR 1
+
+// No command has more than 10 arguments in our
 // list of commands
-#define MAX_NUM_ARGUMENTS 5
+#define MAX_NUM_ARGUMENTS 10
 #define MAX_COMMAND_SIZE 255
 
 #define ATTRIB_HIDDEN 0x1
@@ -33,18 +92,30 @@
 
 #define CIPHER_SIZE 1
 
+// A snapshot keeps its own copy of the inode map in up to
+// SNAPSHOT_MAP_BLOCKS blocks, enough for MAX_INODES inodes
+#define MAX_SNAPSHOTS 16
+#define SNAPSHOT_MAP_BLOCKS 64
+
 ///////////////////////////////////////
 // Forward declarations
 //////////////////////////////////////
 void init(void);
-void parse_tokens(const char *command_string, char **token);
-void free_array(char **arr, size_t size);
+int parse_tokens(char *line, char *token[MAX_NUM_ARGUMENTS]);
+bool take_value(char *tokens[MAX_NUM_ARGUMENTS], const char *flag, char **value);
 void insert(char *tokens[MAX_NUM_ARGUMENTS]);
 void retrieve(char *tokens[MAX_NUM_ARGUMENTS]);
 void readfile(char *tokens[MAX_NUM_ARGUMENTS]);
+void writefile(char *tokens[MAX_NUM_ARGUMENTS]);
+void appendfile(char *tokens[MAX_NUM_ARGUMENTS]);
+void truncatefile(char *tokens[MAX_NUM_ARGUMENTS]);
 void del(char *tokens[MAX_NUM_ARGUMENTS]);
 void undel(char *tokens[MAX_NUM_ARGUMENTS]);
 void list(char *tokens[MAX_NUM_ARGUMENTS]);
+void makedir(char *tokens[MAX_NUM_ARGUMENTS]);
+void removedir(char *tokens[MAX_NUM_ARGUMENTS]);
+void changedir(char *tokens[MAX_NUM_ARGUMENTS]);
+void pwd(char *tokens[MAX_NUM_ARGUMENTS]);
 void openfs(char *tokens[MAX_NUM_ARGUMENTS]);
 void closefs(char *tokens[MAX_NUM_ARGUMENTS]);
 void createfs(char *tokens[MAX_NUM_ARGUMENTS]);
@@ -53,33 +124,113 @@ void attrib(char *tokens[MAX_NUM_ARGUMENTS]);
 void encrypt(char *tokens[MAX_NUM_ARGUMENTS]);
 void decrypt(char *tokens[MAX_NUM_ARGUMENTS]);
 void df(char *tokens[MAX_NUM_ARGUMENTS]);
+void defrag(char *tokens[MAX_NUM_ARGUMENTS]);
+void fsck(char *tokens[MAX_NUM_ARGUMENTS]);
+void scrub(char *tokens[MAX_NUM_ARGUMENTS]);
+void snapshot(char *tokens[MAX_NUM_ARGUMENTS]);
+void use(char *tokens[MAX_NUM_ARGUMENTS]);
+void copy(char *tokens[MAX_NUM_ARGUMENTS]);
+void grep(char *tokens[MAX_NUM_ARGUMENTS]);
+void sync_dir(char *tokens[MAX_NUM_ARGUMENTS]);
+
+// The blocks of the image in use
+uint8_t (*curr_image)[BLOCK_SIZE];
+
+struct superblock
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t size_avail;
+    uint32_t num_inodes;    // always a multiple of INODES_PER_BLOCK
+    uint32_t inodes_in_use;
+    uint32_t inode_hint;    // where the search for a free inode starts
+    uint32_t generation;    // bumped by every savefs, so readers know to reload
+    uint32_t file_generation; // the last generation given to a file
+};
 
-uint8_t curr_image[NUM_BLOCKS][BLOCK_SIZE];
-
+struct superblock *super;
 uint8_t *free_blocks;
-uint8_t *free_inodes;
+int32_t *inode_map;
+uint32_t *checksums;
+uint8_t *snap_refs;
+struct snapshot *snapshots;
 
-uint32_t size_avail;
 uint8_t image_open;
 char image_name[256];
 
+// Directory that relative paths start from
+int32_t cwd;
+
+// Several images can be open at once, each in a slot of its own. The
+// globals above always describe the image in use; select_image saves them
+// to its slot and loads those of another
+#define MAX_IMAGES 8
+
+#define OPEN_PRIVATE 0
+#define OPEN_SHARED 1    // read-only, mapped from the file
+#define OPEN_EXCLUSIVE 2 // the only process that can save the file
+
+struct image
+{
+    char alias[MAX_FILE_LEN];
+    uint8_t (*blocks)[BLOCK_SIZE]; // allocated on first use, then kept
+    char name[256];
+    uint8_t open;
+    int32_t cwd;
+    uint8_t mode;
+    int fd;                     // -1, or the file while it is being read or locked
+    uint8_t (*map)[BLOCK_SIZE]; // --shared: the file, mapped read-only
+    uint32_t generation;        // of the file when it was last mapped
+};
+
+struct image images[MAX_IMAGES];
+int curr_slot;
+
+// File data that `write -' and `append -' have read from stdin, in bytes.
+// Traces record it so that replays can make up the same amount
+int64_t stdin_bytes;
+
+// Directories are hash tables of these entries, DIRENTS_PER_BLOCK to a
+// block. A slot with an empty name has never been used. A slot that has a
+// name but is not in use belongs to a deleted file and can be undeleted,
+// as long as neither its inode nor its blocks have been reused since
 struct directoryEntry
 {
     char filename[MAX_FILE_LEN];
     bool in_use;
     int32_t inode;
+    uint32_t tag; // file_tag of the inode when the entry was deleted
 };
 
 struct inode
 {
-    int32_t blocks[BLOCKS_PER_FILE];
     bool in_use;
     uint8_t attribute;
+    uint8_t type;
     uint32_t file_size;
+    int32_t parent;       // directory holding this one, for ".."
+    union
+    {
+        uint32_t num_entries; // directories: slots that hold a name
+        uint32_t generation;  // files: changed when the file last changed
+    };
+    int32_t direct[NUM_DIRECT];
+    int32_t indirect[NUM_INDIRECT];
 };
 
-struct inode *inodes;
-struct directoryEntry *directory;
+// A frozen copy of the file system. Everything it refers to, from its
+// inode map down to the file data, is shared with the live file system
+// until one of them changes it
+struct snapshot
+{
+    char name[MAX_FILE_LEN];
+    int64_t created;
+    uint32_t num_inodes;
+    uint32_t inodes_in_use;
+    uint32_t inode_hint;
+    uint8_t in_use;
+    int32_t map[SNAPSHOT_MAP_BLOCKS];
+};
 
 // Command stuff
 typedef void (*command_fn)(char *[MAX_NUM_ARGUMENTS]);
@@ -89,872 +240,6248 @@ typedef struct _command
     char *name;
     command_fn run;
     uint8_t num_args;
+    bool modifies; // refused on images open --shared
 } command;
 
-// As of now, we only have 14 commands
-#define NUM_COMMANDS 14
+// As of now, we only have 29 commands
+#define NUM_COMMANDS 29
 
 // We use a table to store and lookup command names and their corresponding functions.
 // Essentially, this is a map/dictionary that is highly modular (compared to a massive
-// switch statement). Also, if the table decides to grow larger, we can always store the
-// elements in order of their keys (the name field), and use binary search when looking up a
-// command as opposed to linearly scanning the commands table
+// switch statement). The elements are stored in order of their keys (the name field,
+// in strcmp order), so looking up a command is a binary search rather than a linear
+// scan. New commands have to go in their sorted place, which main checks at startup
 
 static const command commands[NUM_COMMANDS] = {
-    //  cmd name	call back	min arguments
-
-    {"insert", insert, 1},
-    {"retrieve", retrieve, 1},
-    {"read", readfile, 3},
-    {"del", del, 1},
-    {"undel", undel, 1},
-    {"list", list, 0},
-    {"df", df, 0},
-    {"open", openfs, 1},
-    {"close", closefs, 0},
-    {"createfs", createfs, 1},
-    {"savefs", savefs, 0},
-    {"attrib", attrib, 2},
-    {"encrypt", encrypt, 2},
-    {"decrypt", decrypt, 2},
+    //  cmd name	call back	min arguments	changes the image
+
+    {"append", appendfile, 2, true},
+    {"attrib", attrib, 2, true},
+    {"cd", changedir, 0, false},
+    {"close", closefs, 0, false},
+    {"copy", copy, 2, false},
+    {"createfs", createfs, 1, false},
+    {"decrypt", decrypt, 2, true},
+    {"defrag", defrag, 0, true},
+    {"del", del, 1, true},
+    {"df", df, 0, false},
+    {"encrypt", encrypt, 2, true},
+    {"fsck", fsck, 0, false},
+    {"grep", grep, 1, false},
+    {"insert", insert, 1, true},
+    {"list", list, 0, false},
+    {"mkdir", makedir, 1, true},
+    {"open", openfs, 1, false},
+    {"pwd", pwd, 0, false},
+    {"read", readfile, 3, false},
+    {"retrieve", retrieve, 1, false},
+    {"rmdir", removedir, 1, true},
+    {"savefs", savefs, 0, true},
+    {"scrub", scrub, 0, false},
+    {"snapshot", snapshot, 1, false},
+    {"sync", sync_dir, 1, false},
+    {"truncate", truncatefile, 2, true},
+    {"undel", undel, 1, true},
+    {"use", use, 0, false},
+    {"write", writefile, 3, true},
 };
 // End of command stuff
 
+_Static_assert(sizeof(struct inode) * INODES_PER_BLOCK == BLOCK_SIZE,
+               "inodes must fill a block exactly");
+_Static_assert(sizeof(struct directoryEntry) * DIRENTS_PER_BLOCK <= BLOCK_SIZE,
+               "directory entries do not fit in a block");
+_Static_assert(INODE_MAP + MAX_INODES / INODES_PER_BLOCK * 4 / BLOCK_SIZE <= CHECKSUM_TABLE,
+               "inode map overlaps the checksum table");
+_Static_assert(CHECKSUM_TABLE + NUM_BLOCKS * 4 / BLOCK_SIZE <= SNAPSHOT_REFS,
+               "checksum table overlaps the snapshot reference counts");
+_Static_assert(SNAPSHOT_REFS + NUM_BLOCKS / BLOCK_SIZE <= SNAPSHOT_TABLE,
+               "snapshot reference counts overlap the snapshot table");
+_Static_assert(SNAPSHOT_TABLE * BLOCK_SIZE + MAX_SNAPSHOTS * sizeof(struct snapshot) <=
+                   FIRST_DATA_BLOCK * BLOCK_SIZE,
+               "snapshot table overlaps the data blocks");
+_Static_assert(SNAPSHOT_MAP_BLOCKS * PTRS_PER_BLOCK * INODES_PER_BLOCK >= MAX_INODES,
+               "snapshots can not map MAX_INODES inodes");
+_Static_assert(NUM_DIRECT + NUM_INDIRECT * PTRS_PER_BLOCK >= BLOCKS_PER_FILE,
+               "inodes can not address BLOCKS_PER_FILE blocks");
+
 int32_t findFreeBlock()
 {
     int i;
     for (i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; i++)
     {
-        if (free_blocks[i])
+        if (free_blocks[i] && !snap_refs[i])
         {
             free_blocks[i] = 0;
+            super->size_avail -= BLOCK_SIZE;
             return i;
         }
     }
     return -1;
 }
 
-int32_t findFreeInode()
+// free_blocks only tells whether the live file system uses a block. A
+// block a snapshot still refers to does not become free space until the
+// last such snapshot is dropped
+void releaseBlock(int32_t block)
 {
-    int i;
-    for (i = 0; i < NUM_FILES; i++)
-    {
-        if (free_inodes[i])
-        {
-            assert(!inodes[i].in_use);
+    free_blocks[block] = 1;
+    if (!snap_refs[block])
+        super->size_avail += BLOCK_SIZE;
+}
 
-            free_inodes[i] = 0;
-            return i;
-        }
-    }
-    return -1;
+bool block_is_free(int32_t block)
+{
+    return free_blocks[block] && !snap_refs[block];
 }
 
-int32_t findFreeDirectory()
+void recount_free_space(void)
 {
-    int i;
-    for (i = 0; i < NUM_FILES; ++i)
-    {
-        if (directory[i].in_use == 0) // we found one
-        {
-            return i;
-        }
-    }
-    return -1; // All spots in the directory are taken
+    uint32_t free_count = 0;
+    for (int32_t b = FIRST_DATA_BLOCK; b < NUM_BLOCKS; b++)
+        free_count += block_is_free(b);
+    super->size_avail = free_count * BLOCK_SIZE;
 }
 
-int32_t find_file_by_name(char *name, uint8_t *dir)
+int num_snapshots(void)
 {
-    int32_t inode_num = -1;
+    int count = 0;
+    for (int i = 0; i < MAX_SNAPSHOTS; ++i)
+        count += snapshots[i].in_use;
+    return count;
+}
 
-    int i = 0;
-    for (; i < NUM_FILES; ++i)
+// Blocks a snapshot refers to are never changed in place. Before the live
+// file system writes to one it takes a copy of its own and leaves the
+// original to the snapshots. Returns the block to write to, or -1 if
+// there is no space for the copy
+int32_t cow_block(int32_t block)
+{
+    if (!snap_refs[block])
+        return block;
+
+    int32_t copy = findFreeBlock();
+    if (copy == -1)
+        return -1;
+
+    memcpy(curr_image[copy], curr_image[block], BLOCK_SIZE);
+    checksums[copy] = checksums[block];
+    releaseBlock(block);
+    return copy;
+}
+
+struct inode *inode_at(int32_t inode)
+{
+    struct inode *group = (struct inode *)curr_image[inode_map[inode / INODES_PER_BLOCK]];
+    return &group[inode % INODES_PER_BLOCK];
+}
+
+// The inode, ready to be changed. NULL if its block is shared with a
+// snapshot and there is no space to copy it
+struct inode *inode_mut(int32_t inode)
+{
+    int32_t *group = &inode_map[inode / INODES_PER_BLOCK];
+    int32_t block = cow_block(*group);
+    if (block == -1)
+        return NULL;
+
+    *group = block;
+    return inode_at(inode);
+}
+
+// Returns an inode that is not in use, growing the inode table by one block
+// when all of them are taken. The search picks up where the last one ended
+int32_t findFreeInode()
+{
+    uint32_t n = super->num_inodes;
+
+    for (uint32_t i = 0; super->inodes_in_use < n && i < n; i++)
     {
-        if (directory[i].in_use && !strncmp(name, directory[i].filename, 64))
+        int32_t inode = (super->inode_hint + i) % n;
+        if (!inode_at(inode)->in_use)
         {
-            inode_num = directory[i].inode;
-            break;
+            super->inode_hint = inode + 1;
+            return inode;
         }
     }
 
-    if (dir)
-        *dir = i;
+    if (n == MAX_INODES)
+        return -1;
 
-    return inode_num;
+    int32_t block = findFreeBlock();
+    if (block == -1)
+        return -1;
+
+    memset(curr_image[block], 0, BLOCK_SIZE);
+    inode_map[n / INODES_PER_BLOCK] = block;
+    super->num_inodes += INODES_PER_BLOCK;
+    super->inode_hint = n + 1;
+    return n;
 }
 
-void xor_file(uint32_t inode, uint8_t cipher)
+// Give a file that was changed a new generation, which `sync' compares
+// with the one it last exported
+void file_changed(struct inode *node)
 {
-    int block_idx = 0;
+    if (node->type == INODE_FILE)
+        node->generation = ++super->file_generation;
+}
 
-    // Go through each block that this file uses
-    while (block_idx < BLOCKS_PER_FILE)
-    {
-        uint32_t block_num = inodes[inode].blocks[block_idx];
+// Take a free inode and set it up as an empty file or directory. A file
+// gets a new generation, so the entry of a file that had the inode before
+// no longer matches it
+int32_t alloc_inode(uint8_t type, int32_t parent)
+{
+    int32_t inode = findFreeInode();
+    if (inode == -1)
+        return -1;
+
+    struct inode *node = inode_mut(inode);
+    if (node == NULL)
+        return -1;
+
+    super->inodes_in_use++;
+    node->in_use = 1;
+    node->attribute = 0;
+    node->type = type;
+    node->file_size = 0;
+    node->parent = parent;
+    node->num_entries = 0;
+    memset(node->direct, -1, sizeof(node->direct));
+    memset(node->indirect, -1, sizeof(node->indirect));
+    file_changed(node);
+    return inode;
+}
 
-        // We have reached the end of the file
-        if (block_num == -1)
-            break;
+// The inode keeps its block numbers so that the file can be undeleted
+void release_inode(struct inode *node)
+{
+    super->inodes_in_use--;
+    node->in_use = 0;
+}
 
-        // XOR the block
-        for (int i = 0; i < BLOCK_SIZE; ++i)
-        {
-            curr_image[block_num][i] ^= cipher;
-        }
+bool is_dir(int32_t inode)
+{
+    return inode_at(inode)->type == INODE_DIR;
+}
 
-        block_idx++;
-    }
+int32_t file_num_blocks(struct inode *node)
+{
+    return (node->file_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 }
 
-// copy a file into the disk image
-void insert(char *tokens[MAX_NUM_ARGUMENTS])
+// Where the number of block `idx' of a file is stored: in the inode for the
+// first NUM_DIRECT blocks, in one of the indirect blocks after that. With
+// `alloc' the slot is about to be written: a missing indirect block is
+// allocated and one shared with a snapshot is copied. Otherwise, or if
+// there is no space, NULL is returned
+int32_t *block_slot(struct inode *node, int32_t idx, bool alloc)
 {
-    if (!image_open)
+    if (idx < NUM_DIRECT)
+        return &node->direct[idx];
+
+    idx -= NUM_DIRECT;
+    int32_t *indirect = &node->indirect[idx / PTRS_PER_BLOCK];
+
+    if (*indirect == -1)
     {
-        printf("insert: ERROR: Disk image not open.\n");
-        return;
+        if (!alloc || (*indirect = findFreeBlock()) == -1)
+            return NULL;
+        memset(curr_image[*indirect], -1, BLOCK_SIZE);
+    }
+    else if (alloc)
+    {
+        int32_t block = cow_block(*indirect);
+        if (block == -1)
+            return NULL;
+        *indirect = block;
     }
 
-    char *filename = tokens[1];
+    return (int32_t *)curr_image[*indirect] + idx % PTRS_PER_BLOCK;
+}
 
-    // We do not want slashes in our file name though that does not really constitute a problem
-    // At least support adding files from different directory on the host machine to the image
-    // I have to only use the basename of the filename since we support only one-level directory
-    char *base = basename(filename);
+int32_t file_block(struct inode *node, int32_t idx)
+{
+    int32_t *slot = block_slot(node, idx, false);
+    return slot ? *slot : -1;
+}
+
+bool valid_data_block(int32_t block)
+{
+    return block >= FIRST_DATA_BLOCK && block < NUM_BLOCKS;
+}
+
+// Like file_block, but returns -1 rather than follow a block number that is
+// out of range. For walking images that may be damaged
+int32_t checked_file_block(struct inode *node, int32_t idx)
+{
+    int32_t block = -1;
+
+    if (idx < NUM_DIRECT)
+        block = node->direct[idx];
+    else if (idx < BLOCKS_PER_FILE &&
+             valid_data_block(node->indirect[(idx - NUM_DIRECT) / PTRS_PER_BLOCK]))
+        block = *block_slot(node, idx, false);
+
+    return valid_data_block(block) ? block : -1;
+}
+
+// Allocate block `idx' of a file. Returns the block number or -1. An
+// indirect block taken for it is given back if the block itself can not be
+int32_t file_add_block(struct inode *node, int32_t idx)
+{
+    int32_t *indirect = idx >= NUM_DIRECT ? &node->indirect[(idx - NUM_DIRECT) / PTRS_PER_BLOCK]
+                                          : NULL;
+    bool new_indirect = indirect != NULL && *indirect == -1;
 
-    if (strlen(base) > 64)
+    int32_t *slot = block_slot(node, idx, true);
+    if (slot == NULL)
+        return -1;
+
+    if ((*slot = findFreeBlock()) == -1 && new_indirect)
     {
-        fprintf(stderr, "insert error: filename too long\n");
-        return;
+        releaseBlock(*indirect);
+        *indirect = -1;
     }
+    return *slot;
+}
 
-    int32_t inode = find_file_by_name(base, NULL);
-    if (inode != -1)
+// Block `idx' of a file, ready to be written. -1 if it, or the indirect
+// block holding its number, is shared with a snapshot and there is no
+// space to copy it
+int32_t file_block_mut(struct inode *node, int32_t idx)
+{
+    int32_t *slot = block_slot(node, idx, true);
+    if (slot == NULL)
+        return -1;
+
+    int32_t block = cow_block(*slot);
+    if (block != -1)
+        *slot = block;
+    return block;
+}
+
+// Give every block of a file a copy of its own, so that it can be changed
+// in place without touching the snapshots
+bool unshare_file(struct inode *node)
+{
+    int32_t num_blocks = file_num_blocks(node);
+    for (int32_t idx = 0; idx < num_blocks; ++idx)
     {
-        fprintf(stderr, "ERROR: file already exists\n");
-        return;
+        if (file_block_mut(node, idx) == -1)
+            return false;
     }
+    return true;
+}
 
-    // verify the file exists on host disk
-    struct stat buf;
-    int ret = stat(filename, &buf);
-    if (ret == -1)
+// Release block `from' and everything after it, along with the indirect
+// blocks that are no longer needed. Unless `clear' is set the block numbers
+// stay in the inode so that a deleted file can be undeleted. Numbers past
+// the end of the file in an indirect block that is kept are left alone, as
+// the block may be shared with a snapshot
+void release_file_blocks(struct inode *node, int32_t from, bool clear)
+{
+    int32_t num_blocks = file_num_blocks(node);
+
+    for (int32_t idx = from; idx < num_blocks; ++idx)
     {
-        printf("ERROR: file does not exist.\n");
-        return;
+        int32_t *slot = block_slot(node, idx, false);
+        if (slot == NULL || *slot == -1)
+            break;
+
+        releaseBlock(*slot);
+        if (clear && idx < NUM_DIRECT)
+            *slot = -1;
     }
-    // verify that the file isn't too big
-    if (buf.st_size > MAX_FILE_SIZE)
+
+    for (int k = 0; k < NUM_INDIRECT; ++k)
     {
-        printf("ERROR: file exceeds maximum size.\n");
-        return;
+        if (node->indirect[k] != -1 && from <= NUM_DIRECT + k * PTRS_PER_BLOCK)
+        {
+            releaseBlock(node->indirect[k]);
+            if (clear)
+                node->indirect[k] = -1;
+        }
     }
-    // verify that there is enough space
-    if (buf.st_size > size_avail)
+}
+
+///////////////////////////////////////
+// Checksums
+//////////////////////////////////////
+
+// CRC32C (Castagnoli). Uses the SSE4.2 crc32 instruction when the CPU has
+// it and slicing-by-8 tables otherwise, which handle 8 bytes per step
+uint32_t crc_table[8][256];
+
+uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    crc = ~crc;
+
+    for (; len >= 8; p += 8, len -= 8)
     {
-        printf("ERROR: there is not enough space for a file of this size.\n");
-        return;
+        uint32_t lo = crc ^ (p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24);
+        crc = crc_table[7][lo & 0xFF] ^ crc_table[6][(lo >> 8) & 0xFF] ^
+              crc_table[5][(lo >> 16) & 0xFF] ^ crc_table[4][lo >> 24] ^ crc_table[3][p[4]] ^
+              crc_table[2][p[5]] ^ crc_table[1][p[6]] ^ crc_table[0][p[7]];
     }
 
-    // find an empty directory entry
-    int directory_entry = findFreeDirectory();
-    if (directory_entry == -1) // then we never found a valid one :(
+    while (len--)
+        crc = (crc >> 8) ^ crc_table[0][(crc ^ *p++) & 0xFF];
+
+    return ~crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2"))) uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    uint64_t c = ~crc;
+
+    for (; len >= 8; p += 8, len -= 8)
     {
-        printf("ERROR: no empty directory entry found.\n");
-        return;
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        c = _mm_crc32_u64(c, word);
     }
-    // Find an unused inode
-    int32_t inode_index = findFreeInode();
-    if (inode_index == -1)
+
+    while (len--)
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+
+    return ~(uint32_t)c;
+}
+#endif
+
+uint32_t (*crc32c)(uint32_t crc, const uint8_t *p, size_t len) = crc32c_sw;
+
+void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; ++i)
     {
-        printf("ERROR: could not find a free inode.\n");
-        return;
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j)
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        crc_table[0][i] = crc;
     }
 
-    // Save off the size of the input file
-    // and initialize index variables to zero
-    int32_t copy_size = buf.st_size;
-    int32_t offset = 0;
-    int32_t block_index = 0;
-    int32_t inode_block = 0;
+    for (uint32_t i = 0; i < 256; ++i)
+    {
+        for (int t = 1; t < 8; ++t)
+            crc_table[t][i] = (crc_table[t - 1][i] >> 8) ^ crc_table[0][crc_table[t - 1][i] & 0xFF];
+    }
 
-    // open the input file read-only
-    FILE *input_fp = fopen(filename, "r");
-    printf("Reading %d bytes from %s.\n", (int)buf.st_size, filename);
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c = crc32c_hw;
+#endif
+}
 
-    // "place" into directory
-    directory[directory_entry].in_use = 1;
-    directory[directory_entry].inode = inode_index;
-    strncpy(directory[directory_entry].filename, base, strlen(base));
+uint32_t block_crc(int32_t block)
+{
+    return crc32c(0, curr_image[block], BLOCK_SIZE);
+}
 
-    inodes[inode_index].file_size = buf.st_size;
-    inodes[inode_index].in_use = 1;
-    memset(inodes[inode_index].blocks, -1, BLOCKS_PER_FILE * sizeof(int32_t));
+// Sums up a file: its generation, its size and where its data is and what
+// it holds. Should the inode or any of the blocks go to another file after
+// it is deleted, the tag no longer matches the one its entry kept
+uint32_t file_tag(struct inode *node)
+{
+    uint32_t crc = crc32c(0, (const uint8_t *)&node->generation, sizeof(node->generation));
+    crc = crc32c(crc, (const uint8_t *)&node->file_size, sizeof(node->file_size));
 
-    while (copy_size > 0)
+    int32_t num_blocks = file_num_blocks(node);
+    for (int32_t idx = 0; idx < num_blocks; ++idx)
     {
-        fseek(input_fp, offset, SEEK_SET);
+        int32_t block = checked_file_block(node, idx);
+        crc = crc32c(crc, (const uint8_t *)&block, sizeof(block));
+        if (block != -1)
+            crc = crc32c(crc, curr_image[block], BLOCK_SIZE);
+    }
+    return crc;
+}
 
-        // find a free block
-        block_index = findFreeBlock();
-        if (block_index == -1)
-        {
-            printf("ERROR: no free block found.\n");
-            return;
-        }
+// Data blocks get their checksum as soon as they are written, right after
+// the data went through the cache. Metadata changes all the time, so its
+// checksums are only brought up to date by `savefs'
+void update_checksum(int32_t block)
+{
+    checksums[block] = block_crc(block);
+}
 
-        int32_t bytes = fread(curr_image[block_index], BLOCK_SIZE, 1, input_fp);
+// Call `visit' for every block that holds file system structures rather
+// than file data: the superblock and maps, the inode table, indirect blocks
+// and directories. Block numbers are range checked before they are
+// followed, so this is safe on a damaged image
+void for_each_metadata_block(void (*visit)(int32_t block, void *arg), void *arg)
+{
+    for (int32_t block = 0; block < FIRST_DATA_BLOCK; ++block)
+    {
+        if (block < CHECKSUM_TABLE || block >= SNAPSHOT_REFS)
+            visit(block, arg);
+    }
 
-        // save the block in the inode
-        if (inode_block == BLOCKS_PER_FILE)
+    for (int i = 0; i < MAX_SNAPSHOTS; ++i)
+    {
+        for (int k = 0; snapshots[i].in_use && k < SNAPSHOT_MAP_BLOCKS; ++k)
         {
+            if (valid_data_block(snapshots[i].map[k]))
+                visit(snapshots[i].map[k], arg);
         }
-        inodes[inode_index].blocks[inode_block] = block_index;
+    }
 
-        if (bytes == 0 && !feof(input_fp))
+    uint32_t num_inodes = super->num_inodes < MAX_INODES ? super->num_inodes : MAX_INODES;
+
+    for (uint32_t g = 0; g < num_inodes / INODES_PER_BLOCK; ++g)
+    {
+        if (!valid_data_block(inode_map[g]))
+            continue;
+        visit(inode_map[g], arg);
+
+        struct inode *group = (struct inode *)curr_image[inode_map[g]];
+        for (int i = 0; i < INODES_PER_BLOCK; ++i)
         {
-            free_inodes[inode_index] = 1; // It is now free again
-            printf("ERROR: An error occurred while trying to read from the input file.\n");
-            return;
-        }
+            struct inode *node = &group[i];
+            if (!node->in_use)
+                continue;
+
+            int32_t num_blocks = file_num_blocks(node);
+            if (num_blocks > BLOCKS_PER_FILE)
+                num_blocks = BLOCKS_PER_FILE;
 
-        // clear the EOF flag
-        clearerr(input_fp);
+            for (int k = 0; k < NUM_INDIRECT && num_blocks > NUM_DIRECT + k * PTRS_PER_BLOCK; ++k)
+            {
+                if (valid_data_block(node->indirect[k]))
+                    visit(node->indirect[k], arg);
+            }
 
-        // reduce copy_size by the BLOCK_SIZE bytes
-        copy_size -= BLOCK_SIZE;
+            if (node->type != INODE_DIR)
+                continue;
 
-        // increment offset
-        offset += BLOCK_SIZE;
+            for (int32_t idx = 0; idx < num_blocks; ++idx)
+            {
+                int32_t block = checked_file_block(node, idx);
+                if (block != -1)
+                    visit(block, arg);
+            }
+        }
     }
-    fclose(input_fp);
 }
 
-void retrieve(char *tokens[MAX_NUM_ARGUMENTS])
+void refresh_checksum(int32_t block, void *arg)
 {
-    if (!image_open)
+    update_checksum(block);
+}
+
+void verify_checksum(int32_t block, void *arg)
+{
+    if (checksums[block] != block_crc(block))
     {
-        printf("insert: ERROR: Disk image not open.\n");
-        return;
+        fprintf(stderr, "open: WARNING: checksum mismatch in metadata block %d\n", block);
+        ++*(int *)arg;
     }
+}
 
-    char *src = tokens[1];
-    char *dst = tokens[2] ? tokens[2] : src;
+///////////////////////////////////////
+// Block I/O
+//////////////////////////////////////
 
-    int32_t inode;
+// Transfers between the images and host files. On Linux they are queued on
+// an io_uring, up to IO_QUEUE_DEPTH at a time, with the parts of the images
+// they have used registered as fixed buffers so the kernel does not map
+// their pages for every request.
+// Without io_uring (or with MFS_NO_IO_URING set in the environment) they
+// fall back to pread and pwrite, one request at a time
+#define IO_QUEUE_DEPTH 64
+#define IO_MAX_EXTENT (128 * BLOCK_SIZE)
+
+// One contiguous transfer between the image and a host file
+struct io_req
+{
+    uint8_t *buf;
+    uint32_t len;
+    off_t offset;
+    int64_t done; // bytes transferred so far, or -errno
+    bool finished;
+};
 
-    if ((inode = find_file_by_name(src, NULL)) == -1)
+// Called once for each request as soon as it is finished, whether it
+// completed, stopped at the end of the file or failed, so its data can be
+// worked on while it is still in the cache
+typedef void (*io_done_fn)(struct io_req *req, void *arg);
+
+// Queue `len' bytes at `buf' for `offset' in the host file. Pieces that
+// follow each other both in memory and in the file are merged into one
+// request of up to IO_MAX_EXTENT bytes. Returns the new number of requests
+int io_add_buf(struct io_req *reqs, int n, uint8_t *buf, uint32_t len, off_t offset)
+{
+    if (n > 0)
     {
-        fprintf(stderr, "retrieve: ERROR: File not found\n");
-        return;
+        struct io_req *last = &reqs[n - 1];
+        if (last->buf + last->len == buf && last->offset + last->len == offset &&
+            last->len + len <= IO_MAX_EXTENT)
+        {
+            last->len += len;
+            return n;
+        }
     }
 
-    FILE *temp = fopen(dst, "w");
+    reqs[n].buf = buf;
+    reqs[n].len = len;
+    reqs[n].offset = offset;
+    reqs[n].done = 0;
+    reqs[n].finished = false;
+    return n + 1;
+}
+
+// Queue `len' bytes of image block `block'
+int io_add(struct io_req *reqs, int n, int32_t block, uint32_t len, off_t offset)
+{
+    return io_add_buf(reqs, n, curr_image[block], len, offset);
+}
 
-    if (!temp)
+// Bytes transferred up to the first request that came up short, which for
+// reads is where the host file ends
+int64_t io_total(const struct io_req *reqs, int n)
+{
+    int64_t total = 0;
+    for (int i = 0; i < n && reqs[i].done > 0; ++i)
     {
-        fprintf(stderr, "retrieve: Error: Could not open file `%s' for writing\n", dst);
-        return;
+        total += reqs[i].done;
+        if (reqs[i].done < reqs[i].len)
+            break;
     }
+    return total;
+}
 
-    struct inode this = inodes[inode];
-    uint32_t rem = this.file_size;
-
-    int i = 0;
-    while (rem > 0 && this.blocks[i] != -1)
+void io_sync(int fd, bool write, struct io_req *req)
+{
+    while (req->done >= 0 && req->done < req->len)
     {
-        uint32_t to_copy = BLOCK_SIZE;
-
-        if (rem < BLOCK_SIZE)
-            to_copy = rem;
-
-        assert(i < BLOCKS_PER_FILE);
-
-        fwrite(curr_image[this.blocks[i++]], 1, to_copy, temp);
+        uint8_t *buf = req->buf + req->done;
+        size_t len = req->len - req->done;
+        off_t offset = req->offset + req->done;
+        ssize_t bytes = write ? pwrite(fd, buf, len, offset) : pread(fd, buf, len, offset);
 
-        rem -= BLOCK_SIZE;
+        if (bytes == -1 && errno == EINTR)
+            continue;
+        if (bytes == -1)
+            req->done = -errno;
+        else if (bytes == 0)
+            break;
+        else
+            req->done += bytes;
     }
-
-    fclose(temp);
 }
 
-// Read a file from virtual file system and output it to the terminal
-// as a Hexadecimal value
-void readfile(char *tokens[MAX_NUM_ARGUMENTS])
+#ifdef HAVE_IO_URING
+struct uring
 {
-    if (!image_open)
+    int fd;         // -1 until first used, -2 if io_uring can not be used
+    bool registered;                // whether there are fixed buffers
+    bool no_fixed;                  // registering failed, plain addresses only
+    struct iovec fixed[MAX_IMAGES]; // the part of each image registered
+    int buffer[MAX_IMAGES];         // and its fixed buffer, or -1
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} ring = {.fd = -1};
+
+// The image `buf' is in, or -1 if it is not in one
+int uring_image_of(const uint8_t *buf, size_t len)
+{
+    for (int i = 0; i < MAX_IMAGES; ++i)
     {
-        printf("read: ERROR: Disk image not open.\n");
-        return;
+        const uint8_t *start = images[i].blocks ? &images[i].blocks[0][0] : NULL;
+        if (start != NULL && buf >= start && buf + len <= start + DISK_IMAGE_SIZE)
+            return i;
     }
+    return -1;
+}
 
-    int32_t inode = find_file_by_name(tokens[1], NULL);
-    if (inode == -1)
-    {
-        printf("read: ERROR: Can not find the file.\n");
+// Make sure the image memory the requests are in is registered as a fixed
+// buffer, so the kernel does not map its pages for every request. Only
+// what is transferred gets pinned, from the first to the last byte of the
+// requests, and only when they cover most of that; pinning the gaps
+// between scattered blocks would touch pages nothing asked for. A range
+// that has to grow grows to at least twice its size, as registering again
+// waits for the ring to go quiet. Image memory is never freed, so what is
+// registered stays valid. Not being allowed to pin it is fine, the
+// requests then just pass plain addresses
+void uring_register(const struct io_req *reqs, int n)
+{
+    if (n < 2 || ring.no_fixed)
         return;
-    }
 
-    struct inode this = inodes[inode];
-    if (!this.file_size)
+    uint8_t *lo = reqs[0].buf, *hi = reqs[0].buf + reqs[0].len;
+    size_t total = 0;
+    for (int i = 0; i < n; ++i)
     {
-        printf("read: File is empty\n");
-        return;
+        if (reqs[i].buf < lo)
+            lo = reqs[i].buf;
+        if (reqs[i].buf + reqs[i].len > hi)
+            hi = reqs[i].buf + reqs[i].len;
+        total += reqs[i].len;
     }
 
-    uint32_t pos = atoi(tokens[2]);
-    if (pos > this.file_size)
-    {
-        printf("read: file is only %d bytes", this.file_size);
+    int img = uring_image_of(lo, hi - lo);
+    if (img == -1 || (size_t)(hi - lo) > 2 * total)
         return;
-    }
 
-    int i = pos / BLOCK_SIZE;
-    uint16_t offset = pos % BLOCK_SIZE;
-    int32_t to_print = atoi(tokens[3]);
+    struct iovec *fixed = &ring.fixed[img];
+    uint8_t *old_lo = fixed->iov_base, *old_hi = old_lo + fixed->iov_len;
+    if (fixed->iov_len > 0 && lo >= old_lo && hi <= old_hi)
+        return;
 
-    // Help the user a bit since we don't really expect
-    // them to know how long the file is
-    if (to_print + pos > this.file_size)
-        to_print = this.file_size - pos;
-
-    bool remain = to_print % BLOCK_SIZE; // will the last line have its ascii not printed?
+    uint8_t *start = &images[img].blocks[0][0], *end = start + DISK_IMAGE_SIZE;
+    if (fixed->iov_len > 0)
+    {
+        size_t want = 2 * fixed->iov_len;
+        lo = lo < old_lo ? lo : old_lo;
+        hi = hi > old_hi ? hi : old_hi;
+        if ((size_t)(hi - lo) < want)
+            hi = (size_t)(end - lo) < want ? end : lo + want;
+        if ((size_t)(hi - lo) < want)
+            lo = (size_t)(hi - start) < want ? start : hi - want;
+    }
+    fixed->iov_base = lo;
+    fixed->iov_len = hi - lo;
 
-    int m = pos & 0xF;
-    pos = pos & ~0xF;
+    struct iovec iov[MAX_IMAGES];
+    int num = 0;
+    for (int i = 0; i < MAX_IMAGES; ++i)
+    {
+        ring.buffer[i] = -1;
+        if (ring.fixed[i].iov_len > 0)
+        {
+            ring.buffer[i] = num;
+            iov[num++] = ring.fixed[i];
+        }
+    }
 
-    // Print the first header
-    printf("%06X: ", pos);
-    for (int j = 0; j < m; ++j)
-        printf("-- ");
+    if (ring.registered)
+        syscall(__NR_io_uring_register, ring.fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    ring.registered =
+        syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, num) == 0;
 
-    // TODO:
-    // 1. Change the entire thing to a three step process
-    // 2. First line -> middle lines -> last line (if it has less than 16 bytes)
-    // 3. Remove remain and offset variables
+    if (!ring.registered)
+    {
+        ring.no_fixed = true;
+        for (int i = 0; i < MAX_IMAGES; ++i)
+            ring.buffer[i] = -1;
+    }
+}
 
-    while (to_print > 0 && i < BLOCKS_PER_FILE && this.blocks[i] != -1)
+// Set up the ring the first time it is needed
+bool uring_setup(void)
+{
+    if (ring.fd != -1)
+        return ring.fd >= 0;
+
+    ring.fd = -2;
+    if (getenv("MFS_NO_IO_URING") != NULL)
+        return false;
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, IO_QUEUE_DEPTH, &p);
+    if (fd < 0)
+        return false;
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+    if (single)
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+    uint8_t *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_SQ_RING);
+    uint8_t *cq = single ? sq
+                         : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED)
     {
-        uint32_t end = to_print;
+        close(fd); // closing the ring also lets go of whatever was mapped
+        return false;
+    }
 
-        if (end > BLOCK_SIZE)
-            end = BLOCK_SIZE;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    ring.sqes = sqes;
+
+    ring.fd = fd;
+    return true;
+}
+
+// Put the rest of `req' on the submission queue
+void uring_queue(int fd, bool write, struct io_req *req, unsigned *tail)
+{
+    unsigned idx = *tail & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    int img = ring.registered ? uring_image_of(req->buf, req->len) : -1;
+    int buffer = img != -1 ? ring.buffer[img] : -1;
+
+    if (buffer != -1 && (req->buf < (uint8_t *)ring.fixed[img].iov_base ||
+                         req->buf + req->len >
+                             (uint8_t *)ring.fixed[img].iov_base + ring.fixed[img].iov_len))
+        buffer = -1;
+
+    memset(sqe, 0, sizeof(*sqe));
+    if (buffer != -1)
+        sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+    else
+        sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t)(req->buf + req->done);
+    sqe->len = req->len - req->done;
+    sqe->off = req->offset + req->done;
+    sqe->buf_index = buffer != -1 ? buffer : 0;
+    sqe->user_data = (uintptr_t)req;
+
+    ring.sq_array[idx] = idx;
+    (*tail)++;
+}
+
+// Keep up to IO_QUEUE_DEPTH requests in flight until all are done. Short
+// transfers are queued again for the rest, unless they hit the end of the
+// file. Returns false if the ring itself stopped working
+bool uring_transfer(int fd, bool write, struct io_req *reqs, int n, io_done_fn done, void *arg)
+{
+    uring_register(reqs, n);
 
-        uint8_t *this_blk = curr_image[this.blocks[i]];
+    unsigned tail = *ring.sq_tail;
+    int next = 0, in_flight = 0;
 
-        for (int j = offset; j < (end + offset); ++j)
+    while (next < n || in_flight > 0)
+    {
+        for (; next < n && in_flight < IO_QUEUE_DEPTH; ++next, ++in_flight)
+            uring_queue(fd, write, &reqs[next], &tail);
+        __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned to_submit = tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (syscall(__NR_io_uring_enter, ring.fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0) <
+                0 &&
+            errno != EINTR)
         {
-            // Some fancy printing
-            printf("%02X ", this_blk[j]);
+            return false;
+        }
 
-            // Print the ascii representation of the previous 16 bytes
-            if ((j & 0xF) == 0xF)
+        unsigned head = *ring.cq_head;
+        while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            struct io_req *req = (struct io_req *)(uintptr_t)cqe->user_data;
+            head++;
+
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN)
             {
-                int start = j - 15;
-                if (offset > start)
-                    start = offset;
-                printf("  ");
+                uring_queue(fd, write, req, &tail);
+                continue;
+            }
 
-                putchar('|');
-                {
-                    for (int k = start; k <= j; ++k)
-                    {
-                        char byte = this_blk[k];
-                        if (byte >= 32 && byte < 127) // It is printable
-                        {
-                            putchar(byte);
-                        }
-                        else
-                            putchar('.');
-                    }
-                }
-                putchar('|');
+            if (cqe->res < 0)
+                req->done = cqe->res;
+            else
+                req->done += cqe->res;
 
-                // print next line header
-                pos += 16;
-                printf("\n%06X: ", pos);
+            if (cqe->res > 0 && req->done < req->len)
+                uring_queue(fd, write, req, &tail);
+            else
+            {
+                in_flight--;
+                req->finished = true;
+                if (done != NULL)
+                    done(req, arg);
             }
         }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+#endif
 
-        offset = 0;
-        to_print -= BLOCK_SIZE;
+// Carry out all of the requests, calling `done' (if not NULL) for each one
+// as it finishes. Returns false, with errno set, if any of them failed.
+// Requests that reach the end of the file stop short
+bool io_transfer_each(int fd, bool write, struct io_req *reqs, int n, io_done_fn done, void *arg)
+{
+    bool queued = false;
 
-        ++i;
+#ifdef HAVE_IO_URING
+    if (uring_setup())
+    {
+        queued = uring_transfer(fd, write, reqs, n, done, arg);
+
+        // Should the ring break, the requests are finished the slow way
+        // and io_uring is not used again
+        if (!queued)
+        {
+            close(ring.fd);
+            ring.fd = -2;
+        }
     }
+#endif
 
-    offset = pos % BLOCK_SIZE;
-    if (remain)
+    // Requests the ring already finished are not handed to `done' again
+    for (int i = 0; !queued && i < n; ++i)
     {
+        if (reqs[i].finished)
+            continue;
+        io_sync(fd, write, &reqs[i]);
+        reqs[i].finished = true;
+        if (done != NULL)
+            done(&reqs[i], arg);
     }
 
-    printf("\n");
+    for (int i = 0; i < n; ++i)
+    {
+        if (reqs[i].done < 0)
+        {
+            errno = -reqs[i].done;
+            return false;
+        }
+    }
+    return true;
 }
 
-// Delete a file from the file system using call 'delete
-// An error occurs if a read-only file is marked for deletion
-void del(char *tokens[MAX_NUM_ARGUMENTS])
+bool io_transfer(int fd, bool write, struct io_req *reqs, int n)
 {
-    if (!image_open)
+    return io_transfer_each(fd, write, reqs, n, NULL, NULL);
+}
+
+///////////////////////////////////////
+// Directories
+//////////////////////////////////////
+
+// FNV-1a
+uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_FILE_LEN && name[i]; ++i)
     {
-        printf("ERROR: Disk image is not opened.\n");
-        return;
+        hash ^= (uint8_t)name[i];
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    // verify file exists
-    uint8_t dir_idx;
-    int inode_idx = find_file_by_name(tokens[1], &dir_idx);
-    if (inode_idx == -1)
+int32_t dir_capacity(struct inode *dir)
+{
+    return file_num_blocks(dir) * DIRENTS_PER_BLOCK;
+}
+
+struct directoryEntry *dirent_at(struct inode *dir, int32_t slot)
+{
+    int32_t block = file_block(dir, slot / DIRENTS_PER_BLOCK);
+    return (struct directoryEntry *)curr_image[block] + slot % DIRENTS_PER_BLOCK;
+}
+
+// The entry in `slot', ready to be changed. `dir' has to come from
+// inode_mut. NULL if there is no space to copy its block from a snapshot
+struct directoryEntry *dirent_mut(struct inode *dir, int32_t slot)
+{
+    int32_t block = file_block_mut(dir, slot / DIRENTS_PER_BLOCK);
+    if (block == -1)
+        return NULL;
+    return (struct directoryEntry *)curr_image[block] + slot % DIRENTS_PER_BLOCK;
+}
+
+// Slot of `name' in the directory or -1. With `deleted' set this looks for
+// a deleted entry (for `undel') instead of one in use
+int32_t dir_find(struct inode *dir, const char *name, bool deleted)
+{
+    int32_t capacity = dir_capacity(dir);
+    if (capacity == 0)
+        return -1;
+
+    int32_t slot = name_hash(name) % capacity;
+    for (int32_t i = 0; i < capacity; ++i, slot = (slot + 1) % capacity)
     {
-        printf("delete: ERROR: Can not find the file.\n");
-        return;
+        struct directoryEntry *entry = dirent_at(dir, slot);
+
+        // A slot that was never used ends the probe sequence
+        if (entry->filename[0] == '\0')
+            return -1;
+
+        if (entry->in_use != deleted && !strncmp(entry->filename, name, MAX_FILE_LEN))
+            return slot;
     }
+    return -1;
+}
+
+void index_add(int32_t dir, int32_t slot);
+void index_remove(int32_t dir, int32_t slot);
+void index_invalidate(int32_t dir);
 
-    if (inodes[dir_idx].attribute & ATTRIB_R_ONLY)
+// Put an entry into the first free (or deleted) slot of its probe sequence.
+// `dir' has to come from inode_mut
+int32_t dir_place(struct inode *dir, const struct directoryEntry *entry)
+{
+    int32_t capacity = dir_capacity(dir);
+    int32_t slot = name_hash(entry->filename) % capacity;
+
+    for (int32_t i = 0; i < capacity; ++i, slot = (slot + 1) % capacity)
     {
-        printf("delete: ERROR: Can not delete read-only files.\n");
-        return;
+        struct directoryEntry *this = dirent_at(dir, slot);
+        if (this->filename[0] == '\0' || !this->in_use)
+        {
+            bool fresh = this->filename[0] == '\0';
+            if ((this = dirent_mut(dir, slot)) == NULL)
+                return -1;
+            if (fresh)
+                dir->num_entries++;
+            *this = *entry;
+            return slot;
+        }
     }
+    return -1;
+}
 
-    // set in use to false
-    directory[inode_idx].in_use = 0;
-    inodes[dir_idx].in_use = 0;
+// Whether `undel' could still bring back the deleted `entry': its inode and
+// all of its blocks are free, and still hold what they did when it was
+// deleted. The cheap checks go first, the tag reads the file's data
+bool undeletable(const struct directoryEntry *entry)
+{
+    if (entry->inode < 0 || entry->inode >= super->num_inodes)
+        return false;
 
-    // make space available again
-    size_avail += inodes[dir_idx].file_size;
+    struct inode *node = inode_at(entry->inode);
+    if (node->in_use)
+        return false;
 
-    // free each block in the file
-    for (int i = 0; i < BLOCKS_PER_FILE; i++)
+    int32_t num_blocks = file_num_blocks(node);
+    for (int32_t idx = 0; idx < num_blocks; ++idx)
     {
-        if (inodes[inode_idx].blocks[i] == -1)
-            break;
-        free_blocks[inodes[inode_idx].blocks[i]] = 1;
+        int32_t block = checked_file_block(node, idx);
+        if (block == -1 || !free_blocks[block])
+            return false;
     }
+    return file_tag(node) == entry->tag;
 }
 
-// undelete a previously deleted file using call 'undel'
-void undel(char *tokens[MAX_NUM_ARGUMENTS])
+// Rehash the directory into `new_blocks' blocks (at least as many as it has
+// now). Deleted entries come along as long as they can still be undeleted
+bool dir_rehash(int32_t inode, int32_t new_blocks)
 {
-    if (!image_open)
+    struct inode *dir = inode_mut(inode);
+    if (dir == NULL)
+        return false;
+
+    int32_t old_blocks = file_num_blocks(dir);
+
+    int32_t old_capacity = dir_capacity(dir);
+    struct directoryEntry *saved = malloc((old_capacity + 1) * sizeof(struct directoryEntry));
+    if (saved == NULL)
+        return false;
+
+    for (int32_t slot = 0; slot < old_capacity; ++slot)
+        saved[slot] = *dirent_at(dir, slot);
+
+    // Every old block is about to be rewritten
+    if (!unshare_file(dir))
     {
-        printf("ERROR: Disk image is not opened.\n");
-        return;
+        free(saved);
+        return false;
     }
 
-    uint8_t dir_idx;
-    uint32_t inode_idx = -1;
-
-    int i = 0;
-    for (; i < NUM_FILES; ++i)
+    for (int32_t idx = old_blocks; idx < new_blocks; ++idx)
     {
-        if (!directory[i].in_use && !strncmp(tokens[1], directory[i].filename, 64))
+        if (file_add_block(dir, idx) == -1)
         {
-            inode_idx = directory[i].inode;
-            break;
+            dir->file_size = idx * BLOCK_SIZE;
+            release_file_blocks(dir, old_blocks, true);
+            dir->file_size = old_blocks * BLOCK_SIZE;
+            free(saved);
+            return false;
         }
     }
 
-    if (inode_idx == -1)
+    dir->file_size = new_blocks * BLOCK_SIZE;
+    for (int32_t idx = 0; idx < new_blocks; ++idx)
+        memset(curr_image[file_block(dir, idx)], 0, BLOCK_SIZE);
+
+    dir->num_entries = 0;
+    for (int32_t slot = 0; slot < old_capacity; ++slot)
+    {
+        if (saved[slot].in_use || (saved[slot].filename[0] != '\0' && undeletable(&saved[slot])))
+            dir_place(dir, &saved[slot]);
+    }
+
+    free(saved);
+    index_invalidate(inode);
+    return true;
+}
+
+// Make room in a directory that is getting full. Deleted entries that can
+// no longer be undeleted are dropped, and the table is only doubled if what
+// is left would still fill more than half of it. Returns false if nothing
+// could be freed
+bool dir_make_room(int32_t inode)
+{
+    struct inode *dir = inode_at(inode);
+    int32_t old_blocks = file_num_blocks(dir);
+    int32_t capacity = dir_capacity(dir);
+    uint32_t kept = 0;
+
+    for (int32_t slot = 0; slot < capacity; ++slot)
     {
-        printf("undelete: ERROR: Could not find the file.\n");
-        return;
+        struct directoryEntry *entry = dirent_at(dir, slot);
+        if (entry->in_use || (entry->filename[0] != '\0' && undeletable(entry)))
+            kept++;
     }
 
-    dir_idx = i;
+    int32_t new_blocks = old_blocks;
+    if (old_blocks == 0 || kept * 2 > capacity)
+        new_blocks = old_blocks ? old_blocks * 2 : 1;
+    if (new_blocks > BLOCKS_PER_FILE)
+        new_blocks = BLOCKS_PER_FILE;
+    if (new_blocks == old_blocks && kept == dir->num_entries)
+        return false;
 
-    // set the file back to in-use
-    directory[dir_idx].in_use = 1;
-    inodes[inode_idx].in_use = 1;
+    return dir_rehash(inode, new_blocks);
+}
 
-    // reduce size_available by the file_size
-    size_avail -= inodes[dir_idx].file_size;
+// Add `name' to a directory. Returns its slot, or -1 if the directory is full
+int32_t dir_add(int32_t inode, const char *name, int32_t file)
+{
+    struct inode *dir = inode_mut(inode);
+    if (dir == NULL)
+        return -1;
 
-    // remove requested file from undeleted blocks
-    for (int i = 0; i < BLOCKS_PER_FILE; i++)
+    // Keep the table at most 3/4 full so probe sequences stay short
+    if ((dir->num_entries + 1) * 4 > dir_capacity(dir) * 3 && !dir_make_room(inode) &&
+        dir->num_entries + 1 >= dir_capacity(dir))
     {
-        if (inodes[inode_idx].blocks[i] == -1)
-            break;
-
-        free_blocks[inodes[inode_idx].blocks[i]] = 0;
+        return -1;
     }
+
+    struct directoryEntry entry;
+    memset(&entry, 0, sizeof(entry));
+    memcpy(entry.filename, name, strnlen(name, MAX_FILE_LEN));
+    entry.in_use = 1;
+    entry.inode = file;
+
+    int32_t slot = dir_place(dir, &entry);
+    if (slot != -1)
+        index_add(inode, slot);
+    return slot;
 }
 
-void list(char *tokens[MAX_NUM_ARGUMENTS])
+// Mark an entry deleted. The name stays behind for `undel'. Fails only if
+// there is no space to copy the directory away from a snapshot
+bool dir_remove(int32_t inode, int32_t slot)
 {
-    if (!image_open)
+    struct inode *dir = inode_mut(inode);
+    struct directoryEntry *entry = dir ? dirent_mut(dir, slot) : NULL;
+    if (entry == NULL)
+        return false;
+
+    index_remove(inode, slot);
+    entry->in_use = 0;
+    entry->tag = file_tag(inode_at(entry->inode));
+    return true;
+}
+
+bool dir_empty(struct inode *dir)
+{
+    int32_t capacity = dir_capacity(dir);
+    for (int32_t slot = 0; slot < capacity; ++slot)
     {
-        printf("ERROR: Disk image is not opened.\n");
-        return;
+        if (dirent_at(dir, slot)->in_use)
+            return false;
     }
+    return true;
+}
 
-    bool empty = true;
-    bool list_hidden = false, list_attrib = false;
+// Follow one path component from directory `dir'
+int32_t dir_step(int32_t dir, const char *name)
+{
+    if (!strcmp(name, "."))
+        return dir;
+    if (!strcmp(name, ".."))
+        return inode_at(dir)->parent;
+
+    struct inode *node = inode_at(dir);
+    int32_t slot = dir_find(node, name, false);
+    return slot == -1 ? -1 : dirent_at(node, slot)->inode;
+}
 
-    // Parse options
-    for (int i = 1; i < MAX_NUM_ARGUMENTS && tokens[i] != NULL; ++i)
+// Split `path' into the directory it lives in and its last component, which
+// is copied into `name'. Relative paths start at the current directory.
+// Returns the directory's inode, or -1 if a directory on the way is missing
+int32_t resolve_parent(const char *path, char name[MAX_FILE_LEN + 1])
+{
+    int32_t dir = (*path == '/') ? ROOT_INODE : cwd;
+    name[0] = '\0';
+
+    while (*path)
     {
-        if (*tokens[i] == '-')
+        path += strspn(path, "/");
+        size_t len = strcspn(path, "/");
+        if (len == 0)
+            break;
+        if (len > MAX_FILE_LEN)
+            return -1;
+
+        if (name[0])
         {
-            char opt = tokens[i][1];
-            switch (opt)
-            {
-            case 'h':
-                list_hidden = true;
-                break;
-            case 'a':
-                list_attrib = true;
-                break;
-            case '\0':
-                fprintf(stderr, "list: ERROR: missing option parameter\n");
-                break;
-            default:
-                fprintf(stderr, "list: unrecognized option %c\n", opt);
-            }
+            dir = dir_step(dir, name);
+            if (dir == -1 || !is_dir(dir))
+                return -1;
         }
+
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
     }
 
-    // Very inefficient, I suggest a linked-list structure instead
-    for (int i = 0; i < NUM_FILES; ++i)
+    return dir;
+}
+
+// Find the inode `path' refers to, or -1. If `dir' and `slot' are given they
+// receive the directory entry for it. "/", "." and ".." have no entry of
+// their own and come back with a slot of -1
+int32_t lookup(const char *path, int32_t *dir, int32_t *slot)
+{
+    char name[MAX_FILE_LEN + 1];
+    int32_t parent = resolve_parent(path, name);
+    int32_t found = -1;
+    int32_t at = -1;
+
+    if (parent == -1)
+        return -1;
+
+    if (name[0] == '\0' || !strcmp(name, ".") || !strcmp(name, ".."))
     {
-        if (directory[i].in_use)
-        {
-            struct inode this = inodes[directory[i].inode];
-            if ((this.attribute & ATTRIB_HIDDEN) && !list_hidden)
-            {
-                continue;
-            }
-            char temp[65];
-            char *cpy = directory[i].filename;
+        found = name[0] ? dir_step(parent, name) : parent;
+    }
+    else
+    {
+        struct inode *node = inode_at(parent);
+        at = dir_find(node, name, false);
+        if (at != -1)
+            found = dirent_at(node, at)->inode;
+    }
 
-            int j = 0;
-            while (*cpy && j < 64)
-            {
-                temp[j++] = *(cpy++);
-            }
-            temp[j] = '\0';
+    if (dir)
+        *dir = parent;
+    if (slot)
+        *slot = at;
+    return found;
+}
 
-            empty = false;
-            if (list_attrib)
-            {
-                int spaces = 66 - strlen(temp);
-                printf("%s%*hhu\n", temp, spaces, this.attribute);
-            }
-            else
-                printf("%s\n", temp);
-        }
+// Directory slots of every entry in use in one directory (the one last
+// listed), kept sorted by name and by (size, name). Both are updated as
+// entries come and go so `list' can start at any point without a full scan
+int32_t indexed_dir = -1;
+int32_t *by_name;
+int32_t *by_size;
+int32_t num_indexed;
+int32_t index_capacity;
+
+int compare_name(int32_t slot, const char *name)
+{
+    return strncmp(dirent_at(inode_at(indexed_dir), slot)->filename, name, MAX_FILE_LEN);
+}
+
+int compare_size(int32_t slot, uint32_t size, const char *name)
+{
+    uint32_t this = inode_at(dirent_at(inode_at(indexed_dir), slot)->inode)->file_size;
+    if (this != size)
+        return this < size ? -1 : 1;
+    return compare_name(slot, name);
+}
+
+// First position in by_name whose name is not less than `name'
+int32_t name_lower_bound(const char *name)
+{
+    int32_t lo = 0, hi = num_indexed;
+    while (lo < hi)
+    {
+        int32_t mid = (lo + hi) / 2;
+        if (compare_name(by_name[mid], name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// First position in by_size that does not sort before (size, name)
+int32_t size_lower_bound(uint32_t size, const char *name)
+{
+    int32_t lo = 0, hi = num_indexed;
+    while (lo < hi)
+    {
+        int32_t mid = (lo + hi) / 2;
+        if (compare_size(by_size[mid], size, name) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void index_insert_at(int32_t *index, int32_t pos, int32_t slot)
+{
+    memmove(&index[pos + 1], &index[pos], (num_indexed - pos) * sizeof(int32_t));
+    index[pos] = slot;
+}
+
+// Whether position `pos' of `index' is where `slot' is. If not, the index
+// is out of step with the directory and has to be rebuilt
+bool index_holds(const int32_t *index, int32_t pos, int32_t slot)
+{
+    return pos < num_indexed && index[pos] == slot;
+}
+
+void index_remove_at(int32_t *index, int32_t pos)
+{
+    memmove(&index[pos], &index[pos + 1], (num_indexed - pos - 1) * sizeof(int32_t));
+}
+
+// Make room for `n' slots in both indexes. On failure the index is dropped,
+// to be rebuilt the next time it is needed
+bool index_reserve(int32_t n)
+{
+    if (n <= index_capacity)
+        return true;
+
+    int32_t capacity = index_capacity ? index_capacity : 64;
+    while (capacity < n)
+        capacity *= 2;
+
+    int32_t *names = realloc(by_name, capacity * sizeof(int32_t));
+    int32_t *sizes = names ? realloc(by_size, capacity * sizeof(int32_t)) : NULL;
+
+    by_name = names ? names : by_name;
+    if (sizes == NULL)
+    {
+        indexed_dir = -1;
+        return false;
+    }
+    by_size = sizes;
+    index_capacity = capacity;
+    return true;
+}
+
+// Called once a directory entry becomes in use
+void index_add(int32_t dir, int32_t slot)
+{
+    if (dir != indexed_dir || !index_reserve(num_indexed + 1))
+        return;
+
+    struct directoryEntry *entry = dirent_at(inode_at(dir), slot);
+    uint32_t size = inode_at(entry->inode)->file_size;
+
+    index_insert_at(by_name, name_lower_bound(entry->filename), slot);
+    index_insert_at(by_size, size_lower_bound(size, entry->filename), slot);
+    num_indexed++;
+}
+
+// Called before a directory entry stops being in use
+void index_remove(int32_t dir, int32_t slot)
+{
+    if (dir != indexed_dir)
+        return;
+
+    struct directoryEntry *entry = dirent_at(inode_at(dir), slot);
+    uint32_t size = inode_at(entry->inode)->file_size;
+    int32_t name_pos = name_lower_bound(entry->filename);
+    int32_t size_pos = size_lower_bound(size, entry->filename);
+
+    // Something changed the directory without telling the index
+    if (!index_holds(by_name, name_pos, slot) || !index_holds(by_size, size_pos, slot))
+    {
+        index_invalidate(dir);
+        return;
+    }
+
+    index_remove_at(by_name, name_pos);
+    index_remove_at(by_size, size_pos);
+    num_indexed--;
+}
+
+// Called after the size of the file in `slot' changed from `old_size'
+void index_resize(int32_t dir, int32_t slot, uint32_t old_size)
+{
+    if (dir != indexed_dir)
+        return;
+
+    struct directoryEntry *entry = dirent_at(inode_at(dir), slot);
+    uint32_t size = inode_at(entry->inode)->file_size;
+
+    // The inode already holds the new size, so while looking for where the
+    // entry sits by its old one it has to count as equal to itself
+    int32_t lo = 0, hi = num_indexed;
+    while (lo < hi)
+    {
+        int32_t mid = (lo + hi) / 2;
+        if (by_size[mid] != slot && compare_size(by_size[mid], old_size, entry->filename) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (!index_holds(by_size, lo, slot))
+    {
+        index_invalidate(dir);
+        return;
+    }
+
+    index_remove_at(by_size, lo);
+    num_indexed--;
+    index_insert_at(by_size, size_lower_bound(size, entry->filename), slot);
+    num_indexed++;
+}
+
+// Slots move around when a directory grows, so its index has to go
+void index_invalidate(int32_t dir)
+{
+    if (dir == indexed_dir || dir == -1)
+        indexed_dir = -1;
+}
+
+// qsort orders for index_build
+int sort_by_name(const void *a, const void *b)
+{
+    struct directoryEntry *entry = dirent_at(inode_at(indexed_dir), *(const int32_t *)b);
+    return compare_name(*(const int32_t *)a, entry->filename);
+}
+
+int sort_by_size(const void *a, const void *b)
+{
+    struct directoryEntry *entry = dirent_at(inode_at(indexed_dir), *(const int32_t *)b);
+    return compare_size(*(const int32_t *)a, inode_at(entry->inode)->file_size, entry->filename);
+}
+
+// Gather the slots in use and sort them once, rather than insert them one
+// at a time
+void index_build(int32_t dir)
+{
+    struct inode *node = inode_at(dir);
+    int32_t capacity = dir_capacity(node);
+
+    indexed_dir = dir;
+    num_indexed = 0;
+
+    for (int32_t slot = 0; slot < capacity; ++slot)
+    {
+        if (!dirent_at(node, slot)->in_use)
+            continue;
+        if (!index_reserve(num_indexed + 1))
+            return;
+        by_name[num_indexed++] = slot;
+    }
+
+    // Nothing to sort, and the indexes may not even be allocated yet
+    if (num_indexed == 0)
+        return;
+
+    memcpy(by_size, by_name, num_indexed * sizeof(int32_t));
+    qsort(by_name, num_indexed, sizeof(int32_t), sort_by_name);
+    qsort(by_size, num_indexed, sizeof(int32_t), sort_by_size);
+}
+
+// Work done on each block of a file as it moves between the host and the
+// image, such as encrypting it or keeping its checksum. All of the stages
+// run on a block as soon as it has been read in, or just before it is
+// written out, so each block is only brought into the cache once. `data'
+// holds the `len' bytes of image block `block' at that point: the block
+// itself, or a buffer on the way out to the host
+struct block_stage
+{
+    void (*run)(uint8_t *data, uint32_t len, int32_t block, const void *arg);
+    const void *arg;
+};
+
+void run_stages(const struct block_stage *stages, int n, uint8_t *data, uint32_t len,
+                int32_t block)
+{
+    for (int i = 0; i < n; ++i)
+        stages[i].run(data, len, block, stages[i].arg);
+}
+
+// XOR every byte with the one byte key at `arg'
+void xor_stage(uint8_t *data, uint32_t len, int32_t block, const void *arg)
+{
+    uint8_t cipher = *(const uint8_t *)arg;
+    for (uint32_t i = 0; i < len; ++i)
+        data[i] ^= cipher;
+}
+
+// Record the checksum of the block as it now is in the image
+void checksum_stage(uint8_t *data, uint32_t len, int32_t block, const void *arg)
+{
+    update_checksum(block);
+}
+
+// Read the XOR key `key' into `cipher'. Anything that is not a number is
+// rejected, rather than quietly becoming a key of 0 that changes nothing
+bool parse_key(const char *cmd, const char *key, uint8_t *cipher)
+{
+    char *end;
+    errno = 0;
+    long value = strtol(key, &end, 10);
+    if (end == key || *end != '\0' || errno == ERANGE)
+    {
+        fprintf(stderr, "%s: ERROR: `%s' is not a valid key\n", cmd, key);
+        return false;
+    }
+    *cipher = value & 0xFF;
+    return true;
+}
+
+// Bytes of block `idx' of a file of `size' bytes
+uint32_t block_len(uint32_t size, int32_t idx)
+{
+    uint32_t rem = size - (uint32_t)idx * BLOCK_SIZE;
+    return rem < BLOCK_SIZE ? rem : BLOCK_SIZE;
+}
+
+// Fails, leaving the file as it was, if there is no space to copy it away
+// from a snapshot
+bool xor_file(uint32_t inode, uint8_t cipher)
+{
+    struct inode *node = inode_mut(inode);
+    if (node == NULL || !unshare_file(node))
+        return false;
+
+    file_changed(node);
+    int32_t num_blocks = file_num_blocks(node);
+    const struct block_stage stages[] = {{xor_stage, &cipher}, {checksum_stage, NULL}};
+
+    // Go through each block that this file uses
+    for (int32_t block_idx = 0; block_idx < num_blocks; ++block_idx)
+    {
+        int32_t block = file_block(node, block_idx);
+        run_stages(stages, 2, curr_image[block], BLOCK_SIZE, block);
+    }
+    return true;
+}
+
+// The blocks of a file being inserted, and what to run on each of them
+struct insert_blocks
+{
+    struct inode *node;
+    uint32_t size;
+    const struct block_stage *stages;
+    int num_stages;
+};
+
+// Run the stages on the blocks of a read as soon as it is finished, while
+// they are still in the cache
+void insert_done(struct io_req *req, void *arg)
+{
+    const struct insert_blocks *in = arg;
+    if (req->done <= 0)
+        return;
+
+    int32_t first = req->offset / BLOCK_SIZE;
+    int32_t end = (req->offset + req->done + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (int32_t idx = first; idx < end; ++idx)
+    {
+        int32_t block = file_block(in->node, idx);
+        run_stages(in->stages, in->num_stages, curr_image[block], block_len(in->size, idx),
+                   block);
+    }
+}
+
+// copy a file into the disk image
+// With --xor the blocks are encrypted as they come in, as `encrypt' would
+void insert(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("insert: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    char *key;
+    bool xor = take_value(tokens, "--xor", &key);
+    if ((xor && key == NULL) || tokens[1] == NULL)
+    {
+        fprintf(stderr, "insert: Not enough arguments\n");
+        return;
+    }
+    uint8_t cipher = 0;
+    if (xor && !parse_key("insert", key, &cipher))
+        return;
+
+    char *filename = tokens[1];
+
+    // Files from anywhere on the host are stored under their basename, in
+    // the current directory or in the directory given as second argument
+    char *base = basename(filename);
+    char name[MAX_FILE_LEN + 1];
+    int32_t dir = cwd;
+
+    if (tokens[2] != NULL)
+    {
+        int32_t target = lookup(tokens[2], NULL, NULL);
+        if (target != -1 && is_dir(target))
+            dir = target;
+        else if ((dir = resolve_parent(tokens[2], name)) == -1)
+        {
+            printf("insert: ERROR: directory does not exist.\n");
+            return;
+        }
+        else
+            base = name;
+    }
+
+    if (strlen(base) > MAX_FILE_LEN || *base == '\0')
+    {
+        fprintf(stderr, "insert error: filename too long\n");
+        return;
+    }
+
+    if (dir_find(inode_at(dir), base, false) != -1)
+    {
+        fprintf(stderr, "ERROR: file already exists\n");
+        return;
+    }
+
+    // verify the file exists on host disk
+    struct stat buf;
+    int ret = stat(filename, &buf);
+    if (ret == -1)
+    {
+        printf("ERROR: file does not exist.\n");
+        return;
+    }
+    // verify that the file isn't too big
+    if (buf.st_size > MAX_FILE_SIZE)
+    {
+        printf("ERROR: file exceeds maximum size.\n");
+        return;
+    }
+    // verify that there is enough space
+    if (buf.st_size > super->size_avail)
+    {
+        printf("ERROR: there is not enough space for a file of this size.\n");
+        return;
+    }
+
+    // open the input file read-only
+    int input_fd = open(filename, O_RDONLY);
+    if (input_fd == -1)
+    {
+        printf("ERROR: file does not exist.\n");
+        return;
+    }
+
+    // Find an unused inode
+    int32_t inode_index = alloc_inode(INODE_FILE, dir);
+    if (inode_index == -1)
+    {
+        printf("ERROR: could not find a free inode.\n");
+        close(input_fd);
+        return;
+    }
+
+    struct inode *node = inode_at(inode_index);
+
+    int32_t num_blocks = (buf.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    struct io_req reqs[BLOCKS_PER_FILE];
+    int num_reqs = 0;
+    int32_t inode_block = 0;
+    bool failed = false;
+
+    printf("Reading %d bytes from %s.\n", (int)buf.st_size, filename);
+
+    // Take all of the blocks first, so that the reads can go out together
+    for (; inode_block < num_blocks; ++inode_block)
+    {
+        int32_t block_index = file_add_block(node, inode_block);
+        if (block_index == -1)
+        {
+            printf("ERROR: no free block found.\n");
+            failed = true;
+            break;
+        }
+        num_reqs = io_add(reqs, num_reqs, block_index, BLOCK_SIZE, (off_t)inode_block * BLOCK_SIZE);
+    }
+
+    struct block_stage stages[2];
+    struct insert_blocks in = {node, buf.st_size, stages, 0};
+    if (xor)
+        stages[in.num_stages++] = (struct block_stage){xor_stage, &cipher};
+    stages[in.num_stages++] = (struct block_stage){checksum_stage, NULL};
+
+    if (!failed && (!io_transfer_each(input_fd, false, reqs, num_reqs, insert_done, &in) ||
+                    io_total(reqs, num_reqs) < buf.st_size))
+    {
+        printf("ERROR: An error occurred while trying to read from the input file.\n");
+        failed = true;
+    }
+    close(input_fd);
+
+    node->file_size = buf.st_size;
+    file_changed(node);
+
+    // "place" into directory
+    if (!failed && dir_add(dir, base, inode_index) == -1)
+    {
+        printf("ERROR: no empty directory entry found.\n");
+        failed = true;
+    }
+
+    if (failed)
+    {
+        // Reads that failed part way were never encrypted, so none of the
+        // file is left behind in the image
+        for (int32_t idx = 0; xor && idx < inode_block; ++idx)
+            memset(curr_image[file_block(node, idx)], 0, BLOCK_SIZE);
+
+        // It is now free again
+        node->file_size = inode_block * BLOCK_SIZE;
+        release_file_blocks(node, 0, true);
+        release_inode(node);
+    }
+}
+
+// Remove the option `flag' from the arguments. Returns whether it was there
+bool take_option(char *tokens[MAX_NUM_ARGUMENTS], const char *flag)
+{
+    for (int i = 1; i < MAX_NUM_ARGUMENTS; ++i)
+    {
+        if (tokens[i] != NULL && !strcmp(tokens[i], flag))
+        {
+            memmove(&tokens[i], &tokens[i + 1], (MAX_NUM_ARGUMENTS - i - 1) * sizeof(char *));
+            tokens[MAX_NUM_ARGUMENTS - 1] = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Block `idx' of a file that is about to be read, or -1 (reported) if the
+// image is damaged and it points outside the data area. A bad block number
+// would otherwise be followed before its checksum could say anything
+int32_t read_file_block(const char *cmd, const char *file, struct inode *node, int32_t idx)
+{
+    int32_t block = checked_file_block(node, idx);
+    if (block == -1)
+        fprintf(stderr, "%s: ERROR: `%s' is damaged, block %d of it can not be found\n", cmd,
+                file, idx);
+    return block;
+}
+
+// Check block `idx' of a file against its checksum. Mismatches are reported
+// with both the image block and the block within the file
+bool check_file_block(const char *cmd, const char *file, int32_t block, int32_t idx)
+{
+    if (checksums[block] == block_crc(block))
+        return true;
+
+    fprintf(stderr, "%s: ERROR: checksum mismatch in block %d (block %d of `%s')\n", cmd, block,
+            idx, file);
+    return false;
+}
+
+// Like take_option, for an option followed by a value. Returns whether
+// `flag' was given, and takes the value out along with it. `value' is
+// NULL if nothing follows the flag
+bool take_value(char *tokens[MAX_NUM_ARGUMENTS], const char *flag, char **value)
+{
+    *value = NULL;
+    for (int i = 1; i < MAX_NUM_ARGUMENTS; ++i)
+    {
+        if (tokens[i] != NULL && !strcmp(tokens[i], flag))
+        {
+            int n = 1;
+            if (i + 1 < MAX_NUM_ARGUMENTS && tokens[i + 1] != NULL)
+            {
+                *value = tokens[i + 1];
+                n = 2;
+            }
+            memmove(&tokens[i], &tokens[i + n], (MAX_NUM_ARGUMENTS - i - n) * sizeof(char *));
+            for (int j = MAX_NUM_ARGUMENTS - n; j < MAX_NUM_ARGUMENTS; ++j)
+                tokens[j] = NULL;
+            return true;
+        }
+    }
+    return false;
+}
+
+void retrieve(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("insert: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    // Skip the checksums, for files the caller trusts
+    bool verify = !take_option(tokens, "--no-verify");
+    char *key;
+    bool xor = take_value(tokens, "--xor", &key);
+    if ((xor && key == NULL) || tokens[1] == NULL)
+    {
+        fprintf(stderr, "retrieve: Not enough arguments\n");
+        return;
+    }
+    uint8_t cipher = 0;
+    if (xor && !parse_key("retrieve", key, &cipher))
+        return;
+
+    char *src = tokens[1];
+    char *dst = tokens[2] ? tokens[2] : basename(src);
+
+    int32_t inode;
+
+    if ((inode = lookup(src, NULL, NULL)) == -1)
+    {
+        fprintf(stderr, "retrieve: ERROR: File not found\n");
+        return;
+    }
+
+    if (is_dir(inode))
+    {
+        fprintf(stderr, "retrieve: ERROR: `%s' is a directory\n", src);
+        return;
+    }
+
+    int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "retrieve: Error: Could not open file `%s' for writing\n", dst);
+        return;
+    }
+
+    struct inode *this = inode_at(inode);
+    uint32_t rem = this->file_size;
+
+    // With --xor the blocks are decrypted on their way out, so the image
+    // stays as it is. They go through a buffer of IO_QUEUE_DEPTH blocks
+    // that is written out and reused each time it fills up
+    uint8_t (*out)[BLOCK_SIZE] = NULL;
+    int pending = 0;
+    if (xor && (out = malloc(IO_QUEUE_DEPTH * BLOCK_SIZE)) == NULL)
+    {
+        fprintf(stderr, "retrieve: ERROR: out of memory\n");
+        close(fd);
+        return;
+    }
+    const struct block_stage stages[] = {{xor_stage, &cipher}};
+
+    struct io_req reqs[BLOCKS_PER_FILE];
+    int num_reqs = 0;
+    int i = 0;
+    int corrupt = 0;
+    bool written = true;
+    while (rem > 0 && written)
+    {
+        uint32_t to_copy = BLOCK_SIZE;
+
+        if (rem < BLOCK_SIZE)
+            to_copy = rem;
+
+        int32_t block = read_file_block("retrieve", src, this, i);
+        if (block == -1)
+        {
+            corrupt++;
+            break;
+        }
+        if (verify && !check_file_block("retrieve", src, block, i))
+            corrupt++;
+
+        if (out != NULL)
+        {
+            uint8_t *data = out[pending++];
+            memcpy(data, curr_image[block], to_copy);
+            run_stages(stages, 1, data, to_copy, block);
+            num_reqs = io_add_buf(reqs, num_reqs, data, to_copy, (off_t)i * BLOCK_SIZE);
+        }
+        else
+            num_reqs = io_add(reqs, num_reqs, block, to_copy, (off_t)i * BLOCK_SIZE);
+
+        rem -= to_copy;
+        i++;
+
+        if (pending == IO_QUEUE_DEPTH)
+        {
+            written = io_transfer(fd, true, reqs, num_reqs);
+            num_reqs = pending = 0;
+        }
+    }
+
+    if (!written || !io_transfer(fd, true, reqs, num_reqs))
+        fprintf(stderr, "retrieve: ERROR: could not write `%s': %s\n", dst, strerror(errno));
+
+    close(fd);
+    free(out);
+
+    if (corrupt)
+        fprintf(stderr, "retrieve: ERROR: %d damaged blocks copied to `%s'\n", corrupt, dst);
+}
+
+// Read a file from virtual file system and output it to the terminal
+// as a Hexadecimal value
+void readfile(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("read: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    bool verify = !take_option(tokens, "--no-verify");
+    if (tokens[3] == NULL)
+    {
+        fprintf(stderr, "read: Not enough arguments\n");
+        return;
+    }
+
+    int32_t inode = lookup(tokens[1], NULL, NULL);
+    if (inode == -1 || is_dir(inode))
+    {
+        printf("read: ERROR: Can not find the file.\n");
+        return;
+    }
+
+    struct inode *this = inode_at(inode);
+    if (!this->file_size)
+    {
+        printf("read: File is empty\n");
+        return;
+    }
+
+    uint32_t pos = atoi(tokens[2]);
+    if (pos > this->file_size)
+    {
+        printf("read: file is only %d bytes", this->file_size);
+        return;
+    }
+
+    int i = pos / BLOCK_SIZE;
+    uint16_t offset = pos % BLOCK_SIZE;
+    int32_t to_print = atoi(tokens[3]);
+
+    // Help the user a bit since we don't really expect
+    // them to know how long the file is
+    if (to_print + pos > this->file_size)
+        to_print = this->file_size - pos;
+
+    bool remain = to_print % BLOCK_SIZE; // will the last line have its ascii not printed?
+
+    int m = pos & 0xF;
+    pos = pos & ~0xF;
+
+    // Print the first header
+    printf("%06X: ", pos);
+    for (int j = 0; j < m; ++j)
+        printf("-- ");
+
+    // TODO:
+    // 1. Change the entire thing to a three step process
+    // 2. First line -> middle lines -> last line (if it has less than 16 bytes)
+    // 3. Remove remain and offset variables
+
+    while (to_print > 0 && i < file_num_blocks(this))
+    {
+        uint32_t end = to_print;
+
+        if (end > BLOCK_SIZE)
+            end = BLOCK_SIZE;
+
+        int32_t block = read_file_block("read", tokens[1], this, i);
+        if (block == -1)
+            return;
+        if (verify)
+            check_file_block("read", tokens[1], block, i);
+
+        uint8_t *this_blk = curr_image[block];
+
+        for (int j = offset; j < (end + offset); ++j)
+        {
+            // Some fancy printing
+            printf("%02X ", this_blk[j]);
+
+            // Print the ascii representation of the previous 16 bytes
+            if ((j & 0xF) == 0xF)
+            {
+                int start = j - 15;
+                if (offset > start)
+                    start = offset;
+                printf("  ");
+
+                putchar('|');
+                {
+                    for (int k = start; k <= j; ++k)
+                    {
+                        char byte = this_blk[k];
+                        if (byte >= 32 && byte < 127) // It is printable
+                        {
+                            putchar(byte);
+                        }
+                        else
+                            putchar('.');
+                    }
+                }
+                putchar('|');
+
+                // print next line header
+                pos += 16;
+                printf("\n%06X: ", pos);
+            }
+        }
+
+        offset = 0;
+        to_print -= BLOCK_SIZE;
+
+        ++i;
+    }
+
+    offset = pos % BLOCK_SIZE;
+    if (remain)
+    {
+    }
+
+    printf("\n");
+}
+
+// Read a count, size or offset given on the command line. Anything but a
+// plain decimal number that fits in 32 bits is rejected, so that a typo can
+// not silently become 0
+bool parse_number(const char *cmd, const char *arg, uint32_t *value)
+{
+    char *end;
+    errno = 0;
+    unsigned long n = strtoul(arg, &end, 10);
+    if (!isdigit((unsigned char)*arg) || *end != '\0' || errno == ERANGE || n > UINT32_MAX)
+    {
+        printf("%s: ERROR: `%s' is not a valid number.\n", cmd, arg);
+        return false;
+    }
+    *value = n;
+    return true;
+}
+
+// Copy the contents of the host file `src' into the file in `slot' of
+// directory `dir', starting at byte `offset'. Only the blocks covering the
+// written range are touched, and new blocks are allocated only past the
+// current end. For "-" exactly `count' bytes are taken from stdin, the ones
+// right after the command line, so the commands that follow still run
+void write_range(const char *cmd, int32_t dir, int32_t slot, uint32_t offset, const char *src,
+                 const char *count)
+{
+    int32_t inode = dirent_at(inode_at(dir), slot)->inode;
+
+    if (inode_at(inode)->attribute & ATTRIB_R_ONLY)
+    {
+        printf("%s: ERROR: Can not write to read-only files.\n", cmd);
+        return;
+    }
+
+    struct inode *node = inode_mut(inode);
+    if (node == NULL)
+    {
+        printf("%s: ERROR: no free block found.\n", cmd);
+        return;
+    }
+
+    if (offset > node->file_size)
+    {
+        printf("%s: ERROR: offset is past the end of the file (%u bytes)\n", cmd,
+               node->file_size);
+        return;
+    }
+
+    FILE *fp = stdin;
+    bool from_stdin = !strcmp(src, "-");
+    int64_t length;
+
+    if (from_stdin)
+    {
+        uint32_t n;
+        if (count == NULL)
+        {
+            printf("%s: ERROR: `-' must be followed by the number of bytes to read.\n", cmd);
+            return;
+        }
+        if (!parse_number(cmd, count, &n))
+            return;
+        length = n;
+    }
+    else
+    {
+        struct stat buf;
+        if (stat(src, &buf) == -1)
+        {
+            printf("%s: ERROR: file does not exist.\n", cmd);
+            return;
+        }
+        length = buf.st_size;
+    }
+
+    if (offset + length > MAX_FILE_SIZE)
+    {
+        printf("%s: ERROR: file would exceed maximum size.\n", cmd);
+        return;
+    }
+    if (offset + length > node->file_size &&
+        offset + length - node->file_size > super->size_avail)
+    {
+        printf("%s: ERROR: there is not enough space for a file of this size.\n", cmd);
+        return;
+    }
+    if (!from_stdin && (fp = fopen(src, "r")) == NULL)
+    {
+        fprintf(stderr, "%s: ERROR: Could not open file `%s' for reading\n", cmd, src);
+        return;
+    }
+
+    int32_t num_blocks = file_num_blocks(node);
+    uint32_t old_size = node->file_size;
+    uint32_t pos = offset;
+
+    // A host file is read to its end, stdin only as far as it was told
+    uint32_t end = from_stdin ? offset + length : MAX_FILE_SIZE;
+
+    while (pos < end)
+    {
+        int32_t idx = pos / BLOCK_SIZE;
+        uint32_t in_block = pos % BLOCK_SIZE;
+        bool fresh = false;
+
+        int32_t block;
+
+        if (idx == num_blocks)
+        {
+            block = file_add_block(node, num_blocks);
+            fresh = true;
+        }
+        else
+        {
+            block = file_block_mut(node, idx);
+        }
+
+        if (block == -1)
+        {
+            printf("%s: ERROR: no free block found.\n", cmd);
+            break;
+        }
+        if (fresh)
+            num_blocks++;
+
+        uint32_t want = BLOCK_SIZE - in_block;
+        if (want > end - pos)
+            want = end - pos;
+        size_t bytes = fread(curr_image[block] + in_block, 1, want, fp);
+
+        if (bytes == 0)
+        {
+            // Nothing left to read, give back the block we just took
+            // (and the indirect block that may have come with it)
+            if (fresh)
+            {
+                releaseBlock(block);
+                *block_slot(node, idx, false) = -1;
+                release_file_blocks(node, idx, true);
+            }
+            break;
+        }
+
+        update_checksum(block);
+        pos += bytes;
+    }
+
+    if (ferror(fp))
+        printf("%s: ERROR: An error occurred while trying to read from the input file.\n", cmd);
+    else if (from_stdin && pos < end)
+        printf("%s: ERROR: standard input ended after %u of %u bytes.\n", cmd, pos - offset,
+               (uint32_t)length);
+    else if (!from_stdin && pos == MAX_FILE_SIZE && fgetc(fp) != EOF)
+        printf("%s: ERROR: file exceeds maximum size, only the first %u bytes were kept.\n", cmd,
+               MAX_FILE_SIZE);
+
+    if (from_stdin)
+    {
+        stdin_bytes += pos - offset;
+        clearerr(stdin);
+    }
+    else
+        fclose(fp);
+
+    if (pos > old_size)
+    {
+        node->file_size = pos;
+        index_resize(dir, slot, old_size);
+    }
+    file_changed(node);
+
+    printf("Wrote %u bytes at offset %u.\n", pos - offset, offset);
+}
+
+// Overwrite part of a stored file in place with the contents of a host file
+void writefile(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("write: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    int32_t dir, slot;
+    int32_t inode = lookup(tokens[1], &dir, &slot);
+    if (inode == -1 || slot == -1 || is_dir(inode))
+    {
+        printf("write: ERROR: Can not find the file.\n");
+        return;
+    }
+
+    uint32_t offset;
+    if (parse_number("write", tokens[2], &offset))
+        write_range("write", dir, slot, offset, tokens[3], tokens[4]);
+}
+
+// Add the contents of a host file to the end of a stored file
+void appendfile(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("append: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    int32_t dir, slot;
+    int32_t inode = lookup(tokens[1], &dir, &slot);
+    if (inode == -1 || slot == -1 || is_dir(inode))
+    {
+        printf("append: ERROR: Can not find the file.\n");
+        return;
+    }
+
+    write_range("append", dir, slot, inode_at(inode)->file_size, tokens[2], tokens[3]);
+}
+
+// Shrink or grow a stored file to exactly `size' bytes. Blocks past the new
+// end are released and a file that grows is filled with zeroes
+void truncatefile(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("truncate: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    int32_t dir, slot;
+    int32_t inode = lookup(tokens[1], &dir, &slot);
+    if (inode == -1 || slot == -1 || is_dir(inode))
+    {
+        printf("truncate: ERROR: Can not find the file.\n");
+        return;
+    }
+
+    if (inode_at(inode)->attribute & ATTRIB_R_ONLY)
+    {
+        printf("truncate: ERROR: Can not truncate read-only files.\n");
+        return;
+    }
+
+    uint32_t size;
+    if (!parse_number("truncate", tokens[2], &size))
+        return;
+
+    struct inode *node = inode_mut(inode);
+    if (node == NULL)
+    {
+        printf("truncate: ERROR: no free block found.\n");
+        return;
+    }
+
+    uint32_t old_size = node->file_size;
+
+    if (size > MAX_FILE_SIZE)
+    {
+        printf("truncate: ERROR: file would exceed maximum size.\n");
+        return;
+    }
+    if (size > old_size && size - old_size > super->size_avail)
+    {
+        printf("truncate: ERROR: there is not enough space for a file of this size.\n");
+        return;
+    }
+
+    int32_t num_blocks = file_num_blocks(node);
+    int32_t keep = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    // Release everything past the new end of the file
+    if (num_blocks > keep)
+        release_file_blocks(node, keep, true);
+
+    // Zero the old tail of the last block and any block we add
+    if (size > old_size && old_size % BLOCK_SIZE)
+    {
+        int32_t last = file_block_mut(node, old_size / BLOCK_SIZE);
+        if (last == -1)
+        {
+            printf("truncate: ERROR: no free block found.\n");
+            return;
+        }
+        memset(curr_image[last] + old_size % BLOCK_SIZE, 0, BLOCK_SIZE - old_size % BLOCK_SIZE);
+        update_checksum(last);
+    }
+
+    for (; num_blocks < keep; ++num_blocks)
+    {
+        int32_t block = file_add_block(node, num_blocks);
+        if (block == -1)
+        {
+            printf("truncate: ERROR: no free block found.\n");
+            size = (uint32_t)num_blocks * BLOCK_SIZE;
+            break;
+        }
+        memset(curr_image[block], 0, BLOCK_SIZE);
+        update_checksum(block);
+    }
+
+    node->file_size = size;
+    index_resize(dir, slot, old_size);
+    file_changed(node);
+}
+
+// Delete a file from the file system using call 'delete
+// An error occurs if a read-only file is marked for deletion
+void del(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("ERROR: Disk image is not opened.\n");
+        return;
+    }
+
+    // verify file exists
+    int32_t dir_idx, slot;
+    int inode_idx = lookup(tokens[1], &dir_idx, &slot);
+    if (inode_idx == -1 || slot == -1)
+    {
+        printf("delete: ERROR: Can not find the file.\n");
+        return;
+    }
+
+    if (is_dir(inode_idx))
+    {
+        printf("delete: ERROR: `%s' is a directory, use rmdir.\n", tokens[1]);
+        return;
+    }
+
+    if (inode_at(inode_idx)->attribute & ATTRIB_R_ONLY)
+    {
+        printf("delete: ERROR: Can not delete read-only files.\n");
+        return;
+    }
+
+    // set in use to false
+    struct inode *node = inode_mut(inode_idx);
+    if (node == NULL || !dir_remove(dir_idx, slot))
+    {
+        printf("delete: ERROR: no free block found.\n");
+        return;
+    }
+    release_inode(node);
+
+    // free each block in the file, making space available again
+    release_file_blocks(node, 0, false);
+}
+
+// Take back the blocks of a deleted file. Fails, without taking anything,
+// if any of them has been given to another file since
+bool claim_file_blocks(struct inode *node)
+{
+    int32_t claimed[BLOCKS_PER_FILE + NUM_INDIRECT];
+    int32_t num_claimed = 0;
+    int32_t num_blocks = file_num_blocks(node);
+
+    for (int32_t idx = -NUM_INDIRECT; idx < num_blocks; ++idx)
+    {
+        int32_t block;
+
+        // Indirect blocks first, their contents say where the rest are
+        if (idx < 0)
+        {
+            int k = idx + NUM_INDIRECT;
+            if (num_blocks <= NUM_DIRECT + k * PTRS_PER_BLOCK)
+                continue;
+            block = node->indirect[k];
+        }
+        else
+        {
+            block = file_block(node, idx);
+        }
+
+        if (block < FIRST_DATA_BLOCK || block >= NUM_BLOCKS || !free_blocks[block])
+        {
+            while (num_claimed > 0)
+                free_blocks[claimed[--num_claimed]] = 1;
+            return false;
+        }
+
+        free_blocks[block] = 0;
+        claimed[num_claimed++] = block;
+    }
+
+    // Blocks a snapshot held on to were not counted as free space
+    for (int32_t i = 0; i < num_claimed; ++i)
+    {
+        if (!snap_refs[claimed[i]])
+            super->size_avail -= BLOCK_SIZE;
+    }
+    return true;
+}
+
+// undelete a previously deleted file using call 'undel'
+void undel(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("ERROR: Disk image is not opened.\n");
+        return;
+    }
+
+    char name[MAX_FILE_LEN + 1];
+    int32_t dir_idx = resolve_parent(tokens[1], name);
+    int32_t slot = -1;
+
+    if (dir_idx != -1)
+    {
+        if (dir_find(inode_at(dir_idx), name, false) != -1)
+        {
+            printf("undelete: ERROR: A file with that name already exists.\n");
+            return;
+        }
+        slot = dir_find(inode_at(dir_idx), name, true);
+    }
+
+    if (slot == -1)
+    {
+        printf("undelete: ERROR: Could not find the file.\n");
+        return;
+    }
+
+    // The inode or some of the blocks have been given to another file
+    // since, even if that one was deleted as well
+    struct directoryEntry *entry = dirent_at(inode_at(dir_idx), slot);
+    if (!undeletable(entry))
+    {
+        printf("undelete: ERROR: The file has been overwritten.\n");
+        return;
+    }
+
+    struct inode *parent = inode_mut(dir_idx);
+    entry = parent ? dirent_mut(parent, slot) : NULL;
+    struct inode *node = entry ? inode_mut(entry->inode) : NULL;
+    if (node == NULL)
+    {
+        printf("undelete: ERROR: no free block found.\n");
+        return;
+    }
+
+    // remove requested file from undeleted blocks
+    if (!claim_file_blocks(node))
+    {
+        printf("undelete: ERROR: The file has been overwritten.\n");
+        return;
+    }
+
+    // set the file back to in-use
+    entry->in_use = 1;
+    node->in_use = 1;
+    super->inodes_in_use++;
+    file_changed(node);
+
+    index_add(dir_idx, slot);
+}
+
+#define LIST_BUFFER_ROWS 64
+
+// List the files in a directory in name (or size) order. Files come straight
+// from the sorted indexes, so a page of --limit rows only costs those rows
+// (plus the ones the pattern rejects on the way). Rows are gathered in a
+// buffer of LIST_BUFFER_ROWS and written out each time it fills
+void list(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("ERROR: Disk image is not opened.\n");
+        return;
+    }
+
+    bool list_hidden = false, list_attrib = false, sort_size = false;
+    char *pattern = NULL, *after = NULL;
+    long limit = -1;
+
+    // Parse options
+    for (int i = 1; i < MAX_NUM_ARGUMENTS && tokens[i] != NULL; ++i)
+    {
+        if (!strcmp(tokens[i], "--sort") || !strcmp(tokens[i], "--limit") ||
+            !strcmp(tokens[i], "--after"))
+        {
+            char *opt = tokens[i];
+            char *value = (i + 1 < MAX_NUM_ARGUMENTS) ? tokens[++i] : NULL;
+
+            if (value == NULL)
+            {
+                fprintf(stderr, "list: ERROR: missing parameter for %s\n", opt);
+                return;
+            }
+
+            if (!strcmp(opt, "--after"))
+            {
+                after = value;
+            }
+            else if (!strcmp(opt, "--limit"))
+            {
+                uint32_t n;
+                if (!parse_number("list", value, &n))
+                    return;
+                limit = n;
+            }
+            else if (!strcmp(value, "size") || !strcmp(value, "name"))
+            {
+                sort_size = !strcmp(value, "size");
+            }
+            else
+            {
+                fprintf(stderr, "list: ERROR: can only sort by name or size\n");
+                return;
+            }
+        }
+        else if (*tokens[i] == '-')
+        {
+            char opt = tokens[i][1];
+            switch (opt)
+            {
+            case 'h':
+                list_hidden = true;
+                break;
+            case 'a':
+                list_attrib = true;
+                break;
+            case '\0':
+                fprintf(stderr, "list: ERROR: missing option parameter\n");
+                break;
+            default:
+                fprintf(stderr, "list: unrecognized option %c\n", opt);
+            }
+        }
+        else
+        {
+            pattern = tokens[i];
+        }
+    }
+
+    // A directory lists its contents, anything else is a pattern for the
+    // names in the directory it points into
+    int32_t dir = cwd;
+    char name[MAX_FILE_LEN + 1];
+
+    if (pattern)
+    {
+        int32_t target = lookup(pattern, NULL, NULL);
+        if (target != -1 && is_dir(target))
+        {
+            dir = target;
+            pattern = NULL;
+        }
+        else if ((dir = resolve_parent(pattern, name)) == -1)
+        {
+            fprintf(stderr, "list: ERROR: directory does not exist\n");
+            return;
+        }
+        else
+        {
+            pattern = name;
+        }
+    }
+
+    if (dir != indexed_dir)
+        index_build(dir);
+    if (dir != indexed_dir)
+    {
+        fprintf(stderr, "list: ERROR: out of memory\n");
+        return;
+    }
+
+    struct inode *node = inode_at(dir);
+
+    // The part of the pattern before the first wildcard. In name order all
+    // matches sit in one run of the index, so we can jump there and stop
+    // as soon as the prefix no longer matches
+    char prefix[MAX_FILE_LEN + 1] = "";
+    size_t prefix_len = 0;
+    if (pattern && !sort_size)
+    {
+        prefix_len = strcspn(pattern, "*?[\\");
+        if (prefix_len > MAX_FILE_LEN)
+            prefix_len = MAX_FILE_LEN;
+        memcpy(prefix, pattern, prefix_len);
+        prefix[prefix_len] = '\0';
+    }
+
+    int32_t *index = sort_size ? by_size : by_name;
+    int32_t pos = 0;
+
+    if (after && sort_size)
+    {
+        int32_t slot = dir_find(node, after, false);
+        if (slot == -1)
+        {
+            fprintf(stderr, "list: ERROR: `%s' not found\n", after);
+            return;
+        }
+        pos = size_lower_bound(inode_at(dirent_at(node, slot)->inode)->file_size, after) + 1;
+    }
+    else if (after)
+    {
+        pos = name_lower_bound(after);
+        if (pos < num_indexed && !compare_name(by_name[pos], after))
+            pos++;
+    }
+
+    if (prefix_len)
+    {
+        int32_t first = name_lower_bound(prefix);
+        if (first > pos)
+            pos = first;
+    }
+
+    // Longest row: 64 character name, a size and an attribute column. The
+    // last line may also be `list: more files follow', with a name
+    const size_t row_max = MAX_FILE_LEN + 64;
+    char out[LIST_BUFFER_ROWS * (MAX_FILE_LEN + 64)];
+
+    size_t used = 0;
+    long rows = 0;
+    bool more = false;
+    char last[MAX_FILE_LEN + 1];
+
+    for (; pos < num_indexed; ++pos)
+    {
+        struct directoryEntry *entry = dirent_at(node, index[pos]);
+        struct inode *this = inode_at(entry->inode);
+
+        if (prefix_len && strncmp(entry->filename, prefix, prefix_len))
+            break;
+
+        if ((this->attribute & ATTRIB_HIDDEN) && !list_hidden)
+            continue;
+
+        char temp[MAX_FILE_LEN + 1];
+        int len = strnlen(entry->filename, MAX_FILE_LEN);
+        memcpy(temp, entry->filename, len);
+        temp[len] = '\0';
+
+        if (pattern && fnmatch(pattern, temp, 0))
+            continue;
+
+        if (rows == limit)
+        {
+            more = true;
+            break;
+        }
+
+        memcpy(last, temp, len + 1);
+        rows++;
+
+        // Directories are marked with a trailing slash
+        if (this->type == INODE_DIR)
+            temp[len++] = '/';
+
+        memcpy(out + used, temp, len);
+        used += len;
+
+        if (sort_size)
+            used += sprintf(out + used, "%*u", 66 - len, this->file_size);
+        if (list_attrib)
+            used += sprintf(out + used, "%*hhu", sort_size ? 4 : 66 - len, this->attribute);
+        out[used++] = '\n';
+
+        // Always leave room for one more row, or the line after the last
+        if (used + row_max > sizeof(out))
+        {
+            fwrite(out, 1, used, stdout);
+            used = 0;
+        }
+    }
+
+    if (rows == 0)
+        used += sprintf(out + used, "list: No files found.\n");
+    else if (more)
+        used += sprintf(out + used, "list: more files follow, continue with --after %s\n", last);
+
+    fwrite(out, 1, used, stdout);
+}
+
+// Create a new, empty directory
+void makedir(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("mkdir: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    char name[MAX_FILE_LEN + 1];
+    int32_t dir = resolve_parent(tokens[1], name);
+    if (dir == -1 || name[0] == '\0')
+    {
+        printf("mkdir: ERROR: Invalid path `%s'.\n", tokens[1]);
+        return;
+    }
+
+    if (!strcmp(name, ".") || !strcmp(name, "..") ||
+        dir_find(inode_at(dir), name, false) != -1)
+    {
+        printf("mkdir: ERROR: `%s' already exists.\n", tokens[1]);
+        return;
+    }
+
+    int32_t inode = alloc_inode(INODE_DIR, dir);
+    if (inode == -1)
+    {
+        printf("mkdir: ERROR: could not find a free inode.\n");
+        return;
+    }
+
+    if (dir_add(dir, name, inode) == -1)
+    {
+        printf("mkdir: ERROR: no empty directory entry found.\n");
+        release_inode(inode_at(inode));
+    }
+}
+
+// Remove an empty directory. Like files, it can be brought back with undel
+void removedir(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("rmdir: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    int32_t dir, slot;
+    int32_t inode = lookup(tokens[1], &dir, &slot);
+    if (inode == -1 || !is_dir(inode))
+    {
+        printf("rmdir: ERROR: Can not find the directory.\n");
+        return;
+    }
+
+    if (slot == -1 || inode == cwd)
+    {
+        printf("rmdir: ERROR: Can not remove `%s'.\n", tokens[1]);
+        return;
+    }
+
+    struct inode *node = inode_at(inode);
+    if (node->attribute & ATTRIB_R_ONLY)
+    {
+        printf("rmdir: ERROR: Can not remove read-only directories.\n");
+        return;
+    }
+
+    if (!dir_empty(node))
+    {
+        printf("rmdir: ERROR: Directory not empty.\n");
+        return;
+    }
+
+    if ((node = inode_mut(inode)) == NULL || !dir_remove(dir, slot))
+    {
+        printf("rmdir: ERROR: no free block found.\n");
+        return;
+    }
+    release_inode(node);
+    release_file_blocks(node, 0, false);
+    index_invalidate(inode);
+}
+
+// Change the directory relative paths start from. No argument means the root
+void changedir(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("cd: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    if (tokens[1] == NULL)
+    {
+        cwd = ROOT_INODE;
+        return;
+    }
+
+    int32_t inode = lookup(tokens[1], NULL, NULL);
+    if (inode == -1 || !is_dir(inode))
+    {
+        printf("cd: ERROR: Can not find the directory.\n");
+        return;
+    }
+
+    cwd = inode;
+}
+
+// Write the path of `inode' to the end of `path' and return where it
+// starts. Built back to front: walk up to the root and look up the name of
+// each directory in its parent. Inodes that can not be found in their
+// parent show up as #<inode>
+char *inode_path(int32_t inode, char *path, size_t size)
+{
+    size_t pos = size - 1;
+    path[pos] = '\0';
+
+    for (int depth = 0; inode != ROOT_INODE && depth < size / 2; ++depth)
+    {
+        int32_t parent = inode_at(inode)->parent;
+        if (parent < 0 || parent >= super->num_inodes ||
+            !valid_data_block(inode_map[parent / INODES_PER_BLOCK]))
+            break;
+
+        struct inode *dir = inode_at(parent);
+        char name[MAX_FILE_LEN + 1];
+        int len = snprintf(name, sizeof(name), "#%d", inode);
+
+        for (int32_t idx = 0; idx < file_num_blocks(dir); ++idx)
+        {
+            int32_t block = checked_file_block(dir, idx);
+            struct directoryEntry *entry = (struct directoryEntry *)curr_image[block];
+
+            for (int i = 0; block != -1 && i < DIRENTS_PER_BLOCK; ++i)
+            {
+                if (entry[i].in_use && entry[i].inode == inode)
+                {
+                    len = strnlen(entry[i].filename, MAX_FILE_LEN);
+                    memcpy(name, entry[i].filename, len);
+                }
+            }
+        }
+
+        if (pos < len + 1)
+            break;
+        pos -= len;
+        memcpy(path + pos, name, len);
+        path[--pos] = '/';
+
+        inode = parent;
+    }
+
+    if (path[pos] == '\0')
+        path[--pos] = '/';
+
+    return path + pos;
+}
+
+// Print the path of the current directory
+void pwd(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("pwd: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    char path[4096];
+    printf("%s\n", inode_path(cwd, path, sizeof(path)));
+}
+
+// prints the amount of disk space available in the image
+void df(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("ERROR: Disk Image not opened.\n");
+        return;
+    }
+
+    printf("%d bytes free.\n", super->size_avail);
+}
+
+// Point the globals at the structures inside the image in use
+void map_image(void)
+{
+    if (curr_image == NULL)
+        return;
+
+    super = (struct superblock *)&curr_image[SUPERBLOCK][0];
+    free_blocks = (uint8_t *)&curr_image[FREE_BLOCK_MAP][0];
+    inode_map = (int32_t *)&curr_image[INODE_MAP][0];
+    checksums = (uint32_t *)&curr_image[CHECKSUM_TABLE][0];
+    snap_refs = (uint8_t *)&curr_image[SNAPSHOT_REFS][0];
+    snapshots = (struct snapshot *)&curr_image[SNAPSHOT_TABLE][0];
+}
+
+// Point curr_image at the slot in use: its own copy of the image, or the
+// mapping of the file for --shared
+void view_image(void)
+{
+    struct image *img = &images[curr_slot];
+    curr_image = img->map ? img->map : img->blocks;
+    map_image();
+}
+
+// Save the state of the image in use to its slot
+void sync_image(void)
+{
+    struct image *img = &images[curr_slot];
+    img->open = image_open;
+    img->cwd = cwd;
+    memcpy(img->name, image_name, sizeof(img->name));
+}
+
+void select_image(int slot)
+{
+    if (slot == curr_slot)
+        return;
+
+    sync_image();
+    curr_slot = slot;
+
+    struct image *img = &images[slot];
+    view_image();
+    image_open = img->open;
+    cwd = img->cwd;
+    memcpy(image_name, img->name, sizeof(image_name));
+
+    // The list indexes describe one image only
+    index_invalidate(-1);
+}
+
+// Slot of the open image called `alias', or -1
+int find_image(const char *alias)
+{
+    sync_image();
+    for (int i = 0; i < MAX_IMAGES; ++i)
+    {
+        if (images[i].open && !strncmp(images[i].alias, alias, MAX_FILE_LEN))
+            return i;
+    }
+    return -1;
+}
+
+// Slot for an image called `alias': the one already open under that name,
+// otherwise a free slot, preferring one that has its memory already.
+// `need_blocks' is false for --shared, which maps the file instead
+int claim_image(const char *cmd, const char *alias, bool need_blocks)
+{
+    if (strlen(alias) >= MAX_FILE_LEN || *alias == '\0' || strchr(alias, ':') != NULL)
+    {
+        printf("%s: ERROR: `%s' can not be used as an alias.\n", cmd, alias);
+        return -1;
+    }
+
+    int slot = find_image(alias);
+    for (int i = 0; slot == -1 && i < MAX_IMAGES; ++i)
+    {
+        if (!images[i].open && (images[i].blocks != NULL || !need_blocks))
+            slot = i;
+    }
+    for (int i = 0; slot == -1 && i < MAX_IMAGES; ++i)
+    {
+        if (!images[i].open)
+            slot = i;
+    }
+
+    if (slot == -1)
+    {
+        printf("%s: ERROR: there are already %d images open.\n", cmd, MAX_IMAGES);
+        return -1;
+    }
+
+    if (need_blocks && images[slot].blocks == NULL)
+    {
+        if ((images[slot].blocks = calloc(NUM_BLOCKS, BLOCK_SIZE)) == NULL)
+        {
+            printf("%s: ERROR: out of memory\n", cmd);
+            return -1;
+        }
+    }
+
+    return slot;
+}
+
+// Bytes of the image file that processes lock to coordinate with each
+// other. Nothing is stored there
+#define LOCK_WRITER ((off_t)DISK_IMAGE_SIZE)    // held by open --exclusive
+#define LOCK_DATA ((off_t)DISK_IMAGE_SIZE + 1)  // exclusive while savefs writes
+
+// Take (or with F_UNLCK drop) one of the locks. The locks belong to the
+// open file, not to the process, so opening and closing the same file
+// elsewhere in mfs does not drop them
+bool lock_image(int fd, off_t which, short type, bool wait)
+{
+    struct flock fl = {.l_type = type, .l_whence = SEEK_SET, .l_start = which, .l_len = 1};
+#ifdef F_OFD_SETLK
+    return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl) != -1;
+#else
+    return fcntl(fd, wait ? F_SETLKW : F_SETLK, &fl) != -1;
+#endif
+}
+
+// Map the file of a --shared image over the whole image size. Zero pages
+// are reserved first so that the free tail that savefs leaves out reads
+// as zeros, then the file is mapped over the start. Called again after
+// another process saves, as the length of the file may have changed.
+// Returns the number of blocks in the file, or -1
+int32_t map_image_file(struct image *img)
+{
+    struct stat buf;
+    if (fstat(img->fd, &buf) == -1)
+        return -1;
+
+    size_t len = buf.st_size < DISK_IMAGE_SIZE ? buf.st_size : DISK_IMAGE_SIZE;
+    void *map = mmap(img->map, DISK_IMAGE_SIZE, PROT_READ,
+                     MAP_PRIVATE | MAP_ANONYMOUS | (img->map ? MAP_FIXED : 0), -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    img->map = map;
+
+    if (len > 0 && mmap(map, len, PROT_READ, MAP_SHARED | MAP_FIXED, img->fd, 0) == MAP_FAILED)
+        return -1;
+
+    return len / BLOCK_SIZE;
+}
+
+// Give up the mapping and the locks of a slot
+void release_image(int slot)
+{
+    struct image *img = &images[slot];
+
+    if (img->map != NULL)
+        munmap(img->map, DISK_IMAGE_SIZE);
+    if (img->fd != -1)
+        close(img->fd);
+
+    img->fd = -1;
+    img->map = NULL;
+    img->mode = OPEN_PRIVATE;
+    if (slot == curr_slot)
+        view_image();
+}
+
+// Commands that change the image can not run on a --shared one
+bool image_writable(const char *cmd)
+{
+    if (images[curr_slot].mode != OPEN_SHARED)
+        return true;
+
+    printf("%s: ERROR: `%s' is open --shared, which is read-only\n", cmd, image_name);
+    return false;
+}
+
+// Whether the host file holds an image this version can open, judged by
+// its size and superblock, before anything is read into a slot
+bool image_file_valid(int fd)
+{
+    struct stat buf;
+    struct superblock sb;
+
+    if (fstat(fd, &buf) == -1 || buf.st_size < (off_t)FIRST_DATA_BLOCK * BLOCK_SIZE)
+        return false;
+    if (pread(fd, &sb, sizeof(sb), (off_t)SUPERBLOCK * BLOCK_SIZE) != sizeof(sb))
+        return false;
+
+    return !memcmp(sb.magic, FS_MAGIC, sizeof(FS_MAGIC)) && sb.version == FS_VERSION;
+}
+
+// opens a previously created file system
+// reads whats currently in the image into the FILE* fp
+// set the image to open
+// The image is known by `alias', the base name of the file by default.
+// With --shared the file is mapped read-only instead of read, so that
+// processes reading the same image share one copy of it. With --exclusive
+// no other process can save the file until it is closed
+void openfs(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    uint8_t mode = OPEN_PRIVATE;
+    if (take_option(tokens, "--shared"))
+        mode = OPEN_SHARED;
+    if (take_option(tokens, "--exclusive"))
+        mode = mode == OPEN_SHARED ? 0xFF : OPEN_EXCLUSIVE;
+
+    if (mode == 0xFF || tokens[1] == NULL)
+    {
+        printf("open: ERROR: expected open [--shared|--exclusive] <file> [alias]\n");
+        return;
+    }
+
+    int max_size = sizeof(image_name) - 1;
+    if (strlen(tokens[1]) > max_size)
+    {
+        fprintf(stderr, "Image name should not be longer than %d characters\n", max_size);
+    }
+
+    int fd = open(tokens[1], mode == OPEN_EXCLUSIVE ? O_RDWR : O_RDONLY);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error opening file\n");
+        return;
+    }
+
+    if (mode == OPEN_EXCLUSIVE && !lock_image(fd, LOCK_WRITER, F_WRLCK, false))
+    {
+        printf("open: ERROR: `%s' is open --exclusive in another process\n", tokens[1]);
+        close(fd);
+        return;
+    }
+
+    // Wait for a save by another process to finish
+    lock_image(fd, LOCK_DATA, F_RDLCK, true);
+
+    // Checked before an image already open under the alias is let go of,
+    // so a wrong file leaves it as it was
+    if (!image_file_valid(fd))
+    {
+        fprintf(stderr, "open: ERROR: `%s' is not a version %d file system image\n", tokens[1],
+                FS_VERSION);
+        close(fd);
+        return;
+    }
+
+    char *alias = tokens[2] ? tokens[2] : basename(tokens[1]);
+    int prev = curr_slot;
+    int slot = claim_image("open", alias, mode != OPEN_SHARED);
+    if (slot == -1)
+    {
+        close(fd);
+        return;
+    }
+
+    // An image already open under this alias is replaced
+    release_image(slot);
+    select_image(slot);
+    strncpy(image_name, tokens[1], max_size);
+
+    struct image *img = &images[slot];
+    img->mode = mode;
+    img->fd = fd;
+
+    int read;
+    if (mode == OPEN_SHARED)
+    {
+        read = map_image_file(img);
+        if (read == -1)
+        {
+            fprintf(stderr, "open: ERROR: could not map `%s': %s\n", tokens[1], strerror(errno));
+            read = 0;
+        }
+        view_image();
+        printf("Mapped %d blocks from %s\n", read, tokens[1]);
+    }
+    else
+    {
+        struct io_req reqs[DISK_IMAGE_SIZE / IO_MAX_EXTENT];
+        int num_reqs = 0;
+        for (int32_t block = 0; block < NUM_BLOCKS; ++block)
+            num_reqs = io_add(reqs, num_reqs, block, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+
+        if (!io_transfer(fd, false, reqs, num_reqs))
+            fprintf(stderr, "open: ERROR: could not read `%s': %s\n", tokens[1], strerror(errno));
+
+        read = io_total(reqs, num_reqs) / BLOCK_SIZE;
+        printf("Read %d blocks from %s\n", read, tokens[1]);
+
+        // `savefs' leaves out the free tail of the image
+        memset(curr_image[read], 0, (size_t)(NUM_BLOCKS - read) * BLOCK_SIZE);
+    }
+
+    // Only a file that could not be read after all gets here
+    if (read < FIRST_DATA_BLOCK || memcmp(super->magic, FS_MAGIC, sizeof(FS_MAGIC)) ||
+        super->version != FS_VERSION)
+    {
+        fprintf(stderr, "open: ERROR: `%s' is not a version %d file system image\n", tokens[1],
+                FS_VERSION);
+        release_image(slot);
+        image_open = 0;
+        if (curr_image != NULL)
+            init();
+
+        // A new slot is given up again, leaving the image that was in use
+        if (slot != prev)
+            select_image(prev);
+        return;
+    }
+
+    int damaged = 0;
+    for_each_metadata_block(verify_checksum, &damaged);
+    if (damaged)
+        fprintf(stderr, "open: WARNING: %d metadata blocks do not match their checksum\n", damaged);
+
+    img->generation = super->generation;
+    if (mode == OPEN_PRIVATE)
+    {
+        close(fd);
+        img->fd = -1;
+    }
+    else
+        lock_image(fd, LOCK_DATA, F_UNLCK, false);
+
+    cwd = ROOT_INODE;
+    index_invalidate(-1);
+
+    strncpy(img->alias, alias, MAX_FILE_LEN - 1);
+    image_open = 1;
+}
+
+// closes disk image if it is open
+void closefs(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (image_open == 0)
+    {
+        printf("ERROR: Disk image not open\n");
+        return;
+    }
+
+    image_open = 0;
+    memset(image_name, 0, sizeof(image_name));
+    memset(images[curr_slot].alias, 0, MAX_FILE_LEN);
+    release_image(curr_slot);
+}
+
+// create a new disk image and initialize it
+// Like open, it takes an optional alias
+void createfs(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    int n = strlen(tokens[1]);
+    if (n >= sizeof(image_name))
+    {
+        fprintf(stderr, "Image name too long");
+    }
+
+    // We do this "test run" to check if we can actually write a file
+    // with this name in this directory so the user will not be stranded
+    // later when calling `savefs`. The file is left as it is until then,
+    // as other processes may have it open
+    int fd = open(tokens[1], O_WRONLY | O_CREAT, 0666);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Failed to create file");
+        return;
+    }
+
+    bool locked = !lock_image(fd, LOCK_WRITER, F_WRLCK, false);
+    close(fd);
+    if (locked)
+    {
+        printf("createfs: ERROR: `%s' is open --exclusive in another process\n", tokens[1]);
+        return;
+    }
+
+    char *alias = tokens[2] ? tokens[2] : basename(tokens[1]);
+    int slot = claim_image("createfs", alias, true);
+    if (slot == -1)
+        return;
+
+    release_image(slot);
+    select_image(slot);
+    init();
+    strncpy(image_name, tokens[1], n);
+    strncpy(images[slot].alias, alias, MAX_FILE_LEN - 1);
+
+    printf("File system image created!\n");
+    image_open = 1;
+}
+
+// Switch to the open image called `alias', or list the open images
+void use(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (tokens[1] == NULL)
+    {
+        sync_image();
+        for (int i = 0; i < MAX_IMAGES; ++i)
+        {
+            if (images[i].open)
+                printf("%c %-20s %s\n", i == curr_slot ? '*' : ' ', images[i].alias,
+                       images[i].name);
+        }
+        return;
+    }
+
+    int slot = find_image(tokens[1]);
+    if (slot == -1)
+    {
+        printf("use: ERROR: no image named `%s'\n", tokens[1]);
+        return;
+    }
+    select_image(slot);
+}
+
+// Copy a file from one open image to another: copy <alias>:<file> <alias>[:<name>]
+// Both images are in memory, so the blocks are copied over directly
+void copy(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    char *src_file = strchr(tokens[1], ':');
+    if (src_file == NULL || src_file[1] == '\0')
+    {
+        printf("copy: ERROR: the source should be given as <alias>:<file>\n");
+        return;
+    }
+    *src_file++ = '\0';
+
+    char *dst_path = strchr(tokens[2], ':');
+    if (dst_path != NULL)
+        *dst_path++ = '\0';
+
+    int src = find_image(tokens[1]);
+    int dst = find_image(tokens[2]);
+    if (src == -1 || dst == -1)
+    {
+        printf("copy: ERROR: no image named `%s'\n", src == -1 ? tokens[1] : tokens[2]);
+        return;
+    }
+
+    int prev = curr_slot;
+    select_image(src);
+
+    int32_t inode = lookup(src_file, NULL, NULL);
+    if (inode == -1 || is_dir(inode))
+    {
+        printf("copy: ERROR: `%s' is not a file in %s\n", src_file, tokens[1]);
+        select_image(prev);
+        return;
+    }
+
+    struct inode *src_node = inode_at(inode);
+    uint32_t size = src_node->file_size;
+    uint8_t attribute = src_node->attribute;
+    int32_t num_blocks = file_num_blocks(src_node);
+
+    // Block numbers only mean something within their own image, so keep
+    // pointers to the data instead
+    uint8_t *data[BLOCKS_PER_FILE];
+    uint32_t sums[BLOCKS_PER_FILE];
+    for (int32_t idx = 0; idx < num_blocks; ++idx)
+    {
+        int32_t block = read_file_block("copy", src_file, src_node, idx);
+        if (block == -1)
+        {
+            select_image(prev);
+            return;
+        }
+        data[idx] = curr_image[block];
+        sums[idx] = checksums[block];
+    }
+
+    select_image(dst);
+    if (!image_writable("copy"))
+    {
+        select_image(prev);
+        return;
+    }
+
+    char *base = basename(src_file);
+    char name[MAX_FILE_LEN + 1];
+    int32_t dir = cwd;
+
+    if (dst_path != NULL && *dst_path != '\0')
+    {
+        int32_t target = lookup(dst_path, NULL, NULL);
+        if (target != -1 && is_dir(target))
+            dir = target;
+        else if ((dir = resolve_parent(dst_path, name)) == -1)
+        {
+            printf("copy: ERROR: directory does not exist.\n");
+            select_image(prev);
+            return;
+        }
+        else
+            base = name;
+    }
+
+    if (dir_find(inode_at(dir), base, false) != -1)
+    {
+        printf("copy: ERROR: `%s' already exists in %s\n", base, tokens[2]);
+        select_image(prev);
+        return;
+    }
+
+    if (size > super->size_avail)
+    {
+        printf("copy: ERROR: there is not enough space in %s\n", tokens[2]);
+        select_image(prev);
+        return;
+    }
+
+    int32_t inode_index = alloc_inode(INODE_FILE, dir);
+    if (inode_index == -1)
+    {
+        printf("copy: ERROR: could not find a free inode.\n");
+        select_image(prev);
+        return;
+    }
+
+    struct inode *node = inode_at(inode_index);
+    int32_t idx = 0;
+    bool failed = false;
+
+    for (; idx < num_blocks; ++idx)
+    {
+        int32_t block = file_add_block(node, idx);
+        if (block == -1)
+        {
+            printf("copy: ERROR: no free block found.\n");
+            failed = true;
+            break;
+        }
+
+        memcpy(curr_image[block], data[idx], BLOCK_SIZE);
+        checksums[block] = sums[idx];
+    }
+
+    node->file_size = failed ? idx * BLOCK_SIZE : size;
+    node->attribute = attribute;
+    file_changed(node);
+
+    if (!failed && dir_add(dir, base, inode_index) == -1)
+    {
+        printf("copy: ERROR: no empty directory entry found.\n");
+        failed = true;
+    }
+
+    if (failed)
+    {
+        release_file_blocks(node, 0, true);
+        release_inode(node);
+    }
+    else
+        printf("Copied %u bytes from %s:%s.\n", size, tokens[1], src_file);
+
+    select_image(prev);
+}
+
+// saves the disk image if one is currently open
+void savefs(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (image_open == 0)
+    {
+        printf("ERROR: Disk image is not open\n");
+        return;
+    }
+    char *name = image_name;
+
+    // If they provide a new name
+    if (tokens[1] != NULL)
+        name = tokens[1];
+
+    // An image open --exclusive is saved through the file that holds the
+    // lock. Any other save must not find the file held that way
+    struct image *img = &images[curr_slot];
+    bool own = img->mode == OPEN_EXCLUSIVE && !strcmp(name, image_name);
+    int fd = own ? img->fd : open(name, O_WRONLY | O_CREAT, 0666);
+    if (fd == -1)
+    {
+        fprintf(stderr, "savefs: fatal error: could not open file for writing\n");
+        return;
+    }
+
+    if (!own && !lock_image(fd, LOCK_WRITER, F_WRLCK, false))
+    {
+        printf("savefs: ERROR: `%s' is open --exclusive in another process\n", name);
+        close(fd);
+        return;
+    }
+
+    // Readers of a --shared mapping wait while the file is written, then
+    // see the new generation and map it again
+    lock_image(fd, LOCK_DATA, F_WRLCK, true);
+    super->generation++;
+    img->generation = super->generation;
+
+    for_each_metadata_block(refresh_checksum, NULL);
+
+    // Free blocks at the tail of the image carry no data, so only write up
+    // to the last block in use. After a `defrag' this makes the file shrink
+    int32_t used = NUM_BLOCKS;
+    while (used > FIRST_DATA_BLOCK && block_is_free(used - 1))
+        used--;
+
+    struct io_req reqs[DISK_IMAGE_SIZE / IO_MAX_EXTENT];
+    int num_reqs = 0;
+    for (int32_t block = 0; block < used; ++block)
+        num_reqs = io_add(reqs, num_reqs, block, BLOCK_SIZE, (off_t)block * BLOCK_SIZE);
+
+    // The file is written in place and cut to length afterwards, rather
+    // than truncated first
+    if (!io_transfer(fd, true, reqs, num_reqs) || ftruncate(fd, (off_t)used * BLOCK_SIZE) == -1)
+        fprintf(stderr, "Error, could not write disk image to file\n");
+    else
+        printf("Wrote %d blocks to %s\n", (int)(io_total(reqs, num_reqs) / BLOCK_SIZE), name);
+
+    lock_image(fd, LOCK_DATA, F_UNLCK, false);
+    if (!own)
+        close(fd);
+}
+
+// add and remove attributes to files in the disk image
+// options are +h,+r to add the 'hidden' and 'read-only'
+// attributes, respectively
+//-h and -r are used to remove them
+// Hidden files can only be seen when list -h is invoked
+// Read only files can not be deleted
+void attrib(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("Error: Disk Image not open.\n");
+        return;
+    }
+
+    char *file = tokens[2];
+    if (file == NULL)
+    {
+        printf("attrib: ERROR: File name was not read.\n");
+        return;
+    }
+    int32_t inode;
+
+    if ((inode = lookup(file, NULL, NULL)) == -1)
+    {
+        fprintf(stderr, "attrib: File not found\n");
+        return;
+    }
+
+    char flag = tokens[1][0];
+
+    if (flag == '-' || flag == '+')
+    {
+        bool remove = (flag == '-');
+        uint8_t mask = 0;
+
+        char opt = tokens[1][1];
+
+        switch (opt)
+        {
+        case 'h':
+            mask = ATTRIB_HIDDEN;
+            break;
+        case 'r':
+            mask = ATTRIB_R_ONLY;
+            break;
+        case '\0':
+            fprintf(stderr, "list: ERROR: missing attribute parameter ('h' or 'r')\n");
+            break;
+        default:
+            fprintf(stderr, "list: unrecognized attribute %c\n", opt);
+        }
+
+        if (mask == 0)
+            return;
+
+        struct inode *node = inode_mut(inode);
+        if (node == NULL)
+        {
+            printf("attrib: ERROR: no free block found.\n");
+            return;
+        }
+
+        if (remove)
+        {
+            node->attribute &= ~mask;
+        }
+        else
+        {
+            node->attribute |= mask;
+        }
+        file_changed(node);
+    }
+    else
+    {
+        fprintf(stderr, "list: ERROR: `%s' is not an attribute. Expected attribute\n", tokens[1]);
+        return;
+    }
+}
+
+// Encrypt a file using a 256 bit cypher
+void encrypt(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    char *filename = tokens[1];
+    uint8_t cipher;
+
+    if (!image_open)
+    {
+        printf("Error: Disk Image not open.\n");
+        return;
+    }
+
+    if (!parse_key("encrypt", tokens[2], &cipher))
+        return;
+
+    int32_t inode = lookup(filename, NULL, NULL);
+    if (inode == -1 || is_dir(inode))
+    {
+        fprintf(stderr, "encrypt: File not found\n");
+        return;
+    }
+
+    if (!xor_file(inode, cipher))
+        printf("encrypt: ERROR: no free block found.\n");
+}
+
+// Decrypt encypted cypher
+void decrypt(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    // Beauty of XOR ciphers
+    encrypt(tokens);
+}
+
+// What a block in use holds, for `defrag'. Indirect blocks and blocks of the
+// inode table contain block numbers that have to follow them when they move
+#define BLOCK_DATA 0
+#define BLOCK_INDIRECT 1
+#define BLOCK_INODES 2
+
+int32_t image_offset(const void *p)
+{
+    return (const uint8_t *)p - &curr_image[0][0];
+}
+
+int32_t *image_slot(int32_t offset)
+{
+    return (int32_t *)(&curr_image[0][0] + offset);
+}
+
+// Where a block number stored at `slot' ends up once blocks `from' and `to'
+// have traded places
+int32_t defrag_translate(int32_t slot, int32_t from, int32_t to)
+{
+    if (slot >= 0 && slot / BLOCK_SIZE == from)
+        return to * BLOCK_SIZE + slot % BLOCK_SIZE;
+    if (slot >= 0 && slot / BLOCK_SIZE == to)
+        return from * BLOCK_SIZE + slot % BLOCK_SIZE;
+    return slot;
+}
+
+// Move the block at `from' into the slot `to'. If `to' is in use the two
+// blocks swap places so that nothing is lost. `owner' maps every block in
+// use to the image offset of the block number that references it, or -1 if
+// it is free. Blocks referenced from inside the moving blocks get their
+// owner updated, since those block numbers move along
+void defrag_move(int32_t *owner, uint8_t *kind, int32_t from, int32_t to)
+{
+    static uint8_t tmp[BLOCK_SIZE];
+    static int32_t fix_block[2 * PTRS_PER_BLOCK];
+    static int32_t fix_slot[2 * PTRS_PER_BLOCK];
+
+    int32_t mover = owner[from];
+    int32_t other = owner[to];
+    int32_t ends[2] = {from, to};
+    int num_fixes = 0;
+
+    for (int e = 0; e < (other == -1 ? 1 : 2); ++e)
+    {
+        int32_t block = ends[e];
+        if (kind[block] == BLOCK_DATA)
+            continue;
+
+        for (int32_t off = 0; off < BLOCK_SIZE; off += sizeof(int32_t))
+        {
+            // Inodes hold block numbers in their direct and indirect arrays only
+            int32_t field = off % sizeof(struct inode);
+            if (kind[block] == BLOCK_INODES && field < offsetof(struct inode, direct))
+                continue;
+
+            int32_t slot = block * BLOCK_SIZE + off;
+            int32_t v = *image_slot(slot);
+            if (v >= FIRST_DATA_BLOCK && v < NUM_BLOCKS && v != from && v != to &&
+                owner[v] == slot)
+            {
+                fix_block[num_fixes] = v;
+                fix_slot[num_fixes++] = ends[1 - e] * BLOCK_SIZE + off;
+            }
+        }
+    }
+
+    uint32_t crc = checksums[to];
+    checksums[to] = checksums[from];
+    checksums[from] = crc;
+
+    if (other == -1)
+    {
+        memcpy(curr_image[to], curr_image[from], BLOCK_SIZE);
+        free_blocks[to] = 0;
+        free_blocks[from] = 1;
+    }
+    else
+    {
+        memcpy(tmp, curr_image[to], BLOCK_SIZE);
+        memcpy(curr_image[to], curr_image[from], BLOCK_SIZE);
+        memcpy(curr_image[from], tmp, BLOCK_SIZE);
+    }
+
+    mover = defrag_translate(mover, from, to);
+    other = defrag_translate(other, from, to);
+
+    *image_slot(mover) = to;
+    if (other != -1)
+        *image_slot(other) = from;
+
+    for (int i = 0; i < num_fixes; ++i)
+        owner[fix_block[i]] = fix_slot[i];
+
+    owner[to] = mover;
+    owner[from] = other;
+
+    uint8_t k = kind[to];
+    kind[to] = kind[from];
+    kind[from] = k;
+}
+
+int64_t elapsed_ms(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Move `block' to `cursor' unless it is there already. Returns false once
+// the time budget has run out (the image is consistent after every single
+// move, so stopping is safe)
+bool defrag_place(int32_t *owner, uint8_t *kind, int32_t block, int32_t cursor, uint32_t *moved,
+                  const struct timespec *start, int64_t budget_ms)
+{
+    if (block == cursor)
+        return true;
+
+    if (budget_ms > 0 && elapsed_ms(start) >= budget_ms)
+        return false;
+
+    defrag_move(owner, kind, block, cursor);
+    ++*moved;
+    return true;
+}
+
+// Number of blocks a file takes up, counting its indirect blocks
+int32_t file_total_blocks(struct inode *node)
+{
+    int32_t num_blocks = file_num_blocks(node);
+    if (num_blocks <= NUM_DIRECT)
+        return num_blocks;
+    return num_blocks + (num_blocks - NUM_DIRECT + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+// Lay the blocks of `inode' out one after the other starting at `cursor',
+// each indirect block right before the first block it points to. Returns
+// the first block after the file, or -1 if the time budget ran out
+int32_t defrag_file(int32_t *owner, uint8_t *kind, int32_t inode, int32_t cursor,
+                    uint32_t *moved, const struct timespec *start, int64_t budget_ms)
+{
+    int32_t num_blocks = file_num_blocks(inode_at(inode));
+
+    for (int32_t idx = 0; idx < num_blocks; ++idx)
+    {
+        if (idx >= NUM_DIRECT && (idx - NUM_DIRECT) % PTRS_PER_BLOCK == 0)
+        {
+            int32_t indirect = inode_at(inode)->indirect[(idx - NUM_DIRECT) / PTRS_PER_BLOCK];
+            if (!defrag_place(owner, kind, indirect, cursor++, moved, start, budget_ms))
+                return -1;
+        }
+
+        int32_t block = file_block(inode_at(inode), idx);
+        if (!defrag_place(owner, kind, block, cursor++, moved, start, budget_ms))
+            return -1;
+    }
+    return cursor;
+}
+
+static int32_t *first_block_keys;
+
+int compare_first_block(const void *a, const void *b)
+{
+    int32_t x = first_block_keys[*(const int32_t *)a];
+    int32_t y = first_block_keys[*(const int32_t *)b];
+    return (x > y) - (x < y);
+}
+
+// Relocate blocks into contiguous runs. With no file name (or --all) the
+// inode table is packed toward FIRST_DATA_BLOCK, followed by every file and
+// directory in the order it currently appears on disk. This also leaves all
+// of the free space at the end of the image so `savefs' can write a shorter
+// file
+void defrag(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("defrag: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    // Moving a block would move it out from under the snapshots as well
+    if (num_snapshots() > 0)
+    {
+        printf("defrag: ERROR: can not defragment while there are snapshots, drop them first\n");
+        return;
+    }
+
+    char *file = NULL;
+    int64_t budget_ms = 0;
+
+    for (int i = 1; i < MAX_NUM_ARGUMENTS && tokens[i] != NULL; ++i)
+    {
+        if (!strcmp(tokens[i], "--all"))
+        {
+            file = NULL;
+        }
+        else if (!strcmp(tokens[i], "-t") || !strcmp(tokens[i], "--budget"))
+        {
+            if (i + 1 >= MAX_NUM_ARGUMENTS || tokens[i + 1] == NULL)
+            {
+                fprintf(stderr, "defrag: ERROR: %s expects a time in milliseconds\n", tokens[i]);
+                return;
+            }
+            uint32_t ms;
+            if (!parse_number("defrag", tokens[++i], &ms))
+                return;
+            budget_ms = ms;
+        }
+        else if (*tokens[i] == '-')
+        {
+            fprintf(stderr, "defrag: unrecognized option %s\n", tokens[i]);
+            return;
+        }
+        else
+        {
+            file = tokens[i];
+        }
+    }
+
+    int32_t target = -1;
+    if (file && (target = lookup(file, NULL, NULL)) == -1)
+    {
+        fprintf(stderr, "defrag: ERROR: File not found\n");
+        return;
+    }
+
+    uint32_t num_inodes = super->num_inodes;
+    int32_t *owner = malloc(NUM_BLOCKS * sizeof(int32_t));
+    uint8_t *kind = calloc(NUM_BLOCKS, 1);
+    int32_t *order = malloc((num_inodes + 1) * sizeof(int32_t));
+    int32_t *first = malloc((num_inodes + 1) * sizeof(int32_t));
+    if (!owner || !kind || !order || !first)
+    {
+        fprintf(stderr, "defrag: ERROR: out of memory\n");
+        free(owner);
+        free(kind);
+        free(order);
+        free(first);
+        return;
+    }
+
+    for (int b = 0; b < NUM_BLOCKS; ++b)
+        owner[b] = -1;
+
+    for (uint32_t g = 0; g < num_inodes / INODES_PER_BLOCK; ++g)
+    {
+        owner[inode_map[g]] = image_offset(&inode_map[g]);
+        kind[inode_map[g]] = BLOCK_INODES;
+    }
+
+    int32_t num_files = 0;
+    for (uint32_t inode = 0; inode < num_inodes; ++inode)
+    {
+        struct inode *node = inode_at(inode);
+        if (!node->in_use)
+            continue;
+
+        int32_t num_blocks = file_num_blocks(node);
+        for (int k = 0; k < NUM_INDIRECT && num_blocks > NUM_DIRECT + k * PTRS_PER_BLOCK; ++k)
+        {
+            owner[node->indirect[k]] = image_offset(&node->indirect[k]);
+            kind[node->indirect[k]] = BLOCK_INDIRECT;
+        }
+        for (int32_t idx = 0; idx < num_blocks; ++idx)
+            owner[file_block(node, idx)] = image_offset(block_slot(node, idx, false));
+
+        first[inode] = num_blocks ? node->direct[0] : NUM_BLOCKS;
+        order[num_files++] = inode;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t moved = 0;
+    int32_t cursor = FIRST_DATA_BLOCK;
+    bool finished = true;
+
+    if (target != -1)
+    {
+        // Only move this file: look for the first run that is long enough
+        // and consists solely of free blocks or blocks of the file itself,
+        // so no other file gets fragmented in the process
+        struct inode *node = inode_at(target);
+        int32_t num_blocks = file_num_blocks(node);
+        int32_t n = file_total_blocks(node);
+        int32_t run = 0;
+
+        uint8_t *mine = calloc(NUM_BLOCKS, 1);
+        if (mine == NULL)
+        {
+            fprintf(stderr, "defrag: ERROR: out of memory\n");
+            n = 0;
+        }
+        else
+        {
+            for (int k = 0; k < NUM_INDIRECT && num_blocks > NUM_DIRECT + k * PTRS_PER_BLOCK; ++k)
+                mine[node->indirect[k]] = 1;
+            for (int32_t idx = 0; idx < num_blocks; ++idx)
+                mine[file_block(node, idx)] = 1;
+        }
+
+        cursor = -1;
+        for (int32_t b = FIRST_DATA_BLOCK; b < NUM_BLOCKS && run < n; ++b)
+        {
+            run = (owner[b] == -1 || mine[b]) ? run + 1 : 0;
+            if (run == n)
+                cursor = b - n + 1;
+        }
+        free(mine);
+
+        if (n > 0 && cursor == -1)
+            fprintf(stderr, "defrag: ERROR: no free run of %d blocks for `%s'\n", n, file);
+        else if (n > 0)
+            finished = defrag_file(owner, kind, target, cursor, &moved, &start, budget_ms) != -1;
+    }
+    else
+    {
+        for (uint32_t g = 0; finished && g < num_inodes / INODES_PER_BLOCK; ++g)
+        {
+            finished = defrag_place(owner, kind, inode_map[g], cursor++, &moved, &start,
+                                    budget_ms);
+        }
+
+        first_block_keys = first;
+        qsort(order, num_files, sizeof(int32_t), compare_first_block);
+
+        int step = 1;
+        for (int i = 0; finished && i < num_files; ++i)
+        {
+            int32_t next = defrag_file(owner, kind, order[i], cursor, &moved, &start, budget_ms);
+            if (next == -1)
+            {
+                finished = false;
+                break;
+            }
+            cursor = next;
+
+            // Report every 10% on big runs so long defrags show some life
+            while (num_files >= 10 && step < 10 && (i + 1) * 10 >= step * num_files)
+            {
+                printf("defrag: %d%% (%d/%d files, %u bytes moved)\n", step * 10, i + 1, num_files,
+                       moved * BLOCK_SIZE);
+                step++;
+            }
+        }
+    }
+
+    if (!finished)
+    {
+        printf("defrag: time budget of %lld ms exhausted, run again to continue\n",
+               (long long)budget_ms);
+    }
+
+    printf("defrag: moved %u blocks (%u bytes) in %lld ms\n", moved, moved * BLOCK_SIZE,
+           (long long)elapsed_ms(&start));
+
+    if (target == -1 && finished)
+        printf("defrag: data now ends at block %d\n", cursor - 1);
+
+    free(owner);
+    free(kind);
+    free(order);
+    free(first);
+}
+
+///////////////////////////////////////
+// Worker threads
+//////////////////////////////////////
+
+// fsck, scrub, grep and sync run on at most this many threads
+#define MAX_WORKERS 64
+
+// Run `fn' on `num_threads' threads and wait for all of them. Thread `i'
+// is passed `args' plus `i' times `size' bytes, so with a `size' of 0 they
+// all share `args'. If no thread can be started, `fn' runs here on the
+// first one instead. Returns how many ran
+long run_workers(void *(*fn)(void *), void *args, size_t size, long num_threads)
+{
+    pthread_t threads[MAX_WORKERS];
+    long started = 0;
+
+    for (; started < num_threads && started < MAX_WORKERS; ++started)
+    {
+        if (pthread_create(&threads[started], NULL, fn, (uint8_t *)args + started * size))
+            break;
+    }
+
+    if (started == 0)
+    {
+        fn(args);
+        return 1;
+    }
+
+    for (long i = 0; i < started; ++i)
+        pthread_join(threads[i], NULL);
+    return started;
+}
+
+///////////////////////////////////////
+// Consistency checks
+//////////////////////////////////////
+
+#define PROBLEM_RANGE 0
+#define PROBLEM_DANGLING 1
+#define PROBLEM_CHECKSUM 2
+
+// Workers take this many inodes at a time
+#define FSCK_CHUNK 256
+
+// Detail lines printed before the rest of the problems are only counted
+#define FSCK_MAX_REPORT 50
+
+struct fsck_problem
+{
+    uint8_t kind;
+    int32_t inode;
+    int32_t idx;   // block of the file, or slot of the directory entry
+    int32_t block; // block number, or the inode a directory entry refers to
+};
+
+// Shared by all workers. Every inode is checked by exactly one worker, the
+// counters that several of them update are only touched atomically
+struct fsck_state
+{
+    uint32_t num_inodes;
+    uint32_t next; // first inode of the next chunk to hand out
+    bool scrub;
+    uint32_t *refs;  // references to each block
+    uint32_t *links; // directory entries referring to each inode
+    int32_t *bad_at; // first block of each file that can not be followed
+};
+
+struct fsck_worker
+{
+    struct fsck_state *state;
+    struct fsck_problem *problems;
+    uint32_t num_problems;
+    uint32_t capacity;
+    uint32_t blocks; // blocks checked
+};
+
+void fsck_problem(struct fsck_worker *w, uint8_t kind, int32_t inode, int32_t idx, int32_t block)
+{
+    if (w->num_problems == w->capacity)
+    {
+        uint32_t capacity = w->capacity ? w->capacity * 2 : 64;
+        struct fsck_problem *problems = realloc(w->problems, capacity * sizeof(*problems));
+        if (problems == NULL)
+            return;
+        w->problems = problems;
+        w->capacity = capacity;
+    }
+
+    struct fsck_problem *p = &w->problems[w->num_problems++];
+    p->kind = kind;
+    p->inode = inode;
+    p->idx = idx;
+    p->block = block;
+}
+
+bool inode_exists(int32_t inode, uint32_t num_inodes)
+{
+    return inode >= 0 && inode < num_inodes &&
+           valid_data_block(inode_map[inode / INODES_PER_BLOCK]) && inode_at(inode)->in_use;
+}
+
+// Follow the block list of one inode, counting a reference for every block
+// it uses, and check the entries of directories
+void fsck_inode(struct fsck_worker *w, int32_t inode)
+{
+    struct fsck_state *st = w->state;
+    struct inode *node = inode_at(inode);
+
+    if (!node->in_use)
+        return;
+
+    int32_t num_blocks = file_num_blocks(node);
+    if (num_blocks > BLOCKS_PER_FILE)
+    {
+        fsck_problem(w, PROBLEM_RANGE, inode, BLOCKS_PER_FILE, -1);
+        st->bad_at[inode] = num_blocks = BLOCKS_PER_FILE;
+    }
+
+    for (int32_t idx = 0; idx < num_blocks; ++idx)
+    {
+        if (idx >= NUM_DIRECT && (idx - NUM_DIRECT) % PTRS_PER_BLOCK == 0)
+        {
+            int32_t indirect = node->indirect[(idx - NUM_DIRECT) / PTRS_PER_BLOCK];
+            if (!valid_data_block(indirect))
+            {
+                fsck_problem(w, PROBLEM_RANGE, inode, idx, indirect);
+                st->bad_at[inode] = num_blocks = idx;
+                break;
+            }
+            __atomic_fetch_add(&st->refs[indirect], 1, __ATOMIC_RELAXED);
+            w->blocks++;
+        }
+
+        int32_t block = *block_slot(node, idx, false);
+        if (!valid_data_block(block))
+        {
+            fsck_problem(w, PROBLEM_RANGE, inode, idx, block);
+            st->bad_at[inode] = num_blocks = idx;
+            break;
+        }
+        __atomic_fetch_add(&st->refs[block], 1, __ATOMIC_RELAXED);
+        w->blocks++;
+
+        if (st->scrub && node->type == INODE_FILE && checksums[block] != block_crc(block))
+            fsck_problem(w, PROBLEM_CHECKSUM, inode, idx, block);
+    }
+
+    if (node->type != INODE_DIR)
+        return;
+
+    for (int32_t idx = 0; idx < num_blocks; ++idx)
+    {
+        struct directoryEntry *entry = (struct directoryEntry *)curr_image[file_block(node, idx)];
+
+        for (int i = 0; i < DIRENTS_PER_BLOCK; ++i)
+        {
+            if (!entry[i].in_use)
+                continue;
+
+            if (inode_exists(entry[i].inode, st->num_inodes))
+                __atomic_fetch_add(&st->links[entry[i].inode], 1, __ATOMIC_RELAXED);
+            else
+                fsck_problem(w, PROBLEM_DANGLING, inode, idx * DIRENTS_PER_BLOCK + i,
+                             entry[i].inode);
+        }
+    }
+}
+
+void *fsck_run_worker(void *arg)
+{
+    struct fsck_worker *w = arg;
+    struct fsck_state *st = w->state;
+
+    for (;;)
+    {
+        uint32_t first = __atomic_fetch_add(&st->next, FSCK_CHUNK, __ATOMIC_RELAXED);
+        if (first >= st->num_inodes)
+            break;
+
+        uint32_t last = first + FSCK_CHUNK < st->num_inodes ? first + FSCK_CHUNK : st->num_inodes;
+        for (uint32_t inode = first; inode < last; ++inode)
+        {
+            // Groups missing from the inode map are reported by fsck itself
+            if (valid_data_block(inode_map[inode / INODES_PER_BLOCK]))
+                fsck_inode(w, inode);
+        }
+    }
+    return NULL;
+}
+
+void fsck_report(const char *cmd, uint32_t *shown, const char *fmt, ...)
+{
+    if ((*shown)++ >= FSCK_MAX_REPORT)
+        return;
+
+    va_list args;
+    va_start(args, fmt);
+    printf("%s: ", cmd);
+    vprintf(fmt, args);
+    va_end(args);
+}
+
+// Give the block in `slot' a copy of its own if it is shared with a file
+// seen before
+void fsck_unshare(int32_t *slot, uint32_t *refs, uint8_t *kept)
+{
+    int32_t block = *slot;
+
+    if (!kept[block])
+    {
+        kept[block] = 1;
+        return;
+    }
+
+    int32_t copy = findFreeBlock();
+    if (copy == -1)
+        return;
+
+    memcpy(curr_image[copy], curr_image[block], BLOCK_SIZE);
+    checksums[copy] = checksums[block];
+    refs[block]--;
+    refs[copy] = 1;
+    kept[copy] = 1;
+    *slot = copy;
+}
+
+// Cross-check the free block map, the inodes and the directories, on
+// several threads at once. With `repair' the problems found are fixed:
+// - files are cut off before the first block number that can not be followed
+// - directory entries that refer to missing inodes are removed
+// - files that are in no directory are added to the root as #<inode>
+// - every file that shares a block with another one gets a copy of it
+// - the free block map and the counters in the superblock are rebuilt
+// With `scrub' every data block is also checked against its checksum
+void check_image(const char *cmd, char *tokens[MAX_NUM_ARGUMENTS], bool scrub)
+{
+    if (!image_open)
+    {
+        printf("%s: ERROR: Disk image not open.\n", cmd);
+        return;
+    }
+
+    bool repair = false;
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < MAX_NUM_ARGUMENTS && tokens[i] != NULL; ++i)
+    {
+        if (!strcmp(tokens[i], "--repair"))
+        {
+            repair = true;
+        }
+        else if (!strcmp(tokens[i], "-j"))
+        {
+            if (i + 1 >= MAX_NUM_ARGUMENTS || tokens[i + 1] == NULL)
+            {
+                fprintf(stderr, "%s: ERROR: -j expects a number of threads\n", cmd);
+                return;
+            }
+            num_threads = atol(tokens[++i]);
+        }
+        else
+        {
+            fprintf(stderr, "%s: unrecognized option %s\n", cmd, tokens[i]);
+            return;
+        }
+    }
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_WORKERS)
+        num_threads = MAX_WORKERS;
+
+    if (repair && !image_writable(cmd))
+        return;
+
+    // Repairs write in place, which would change the snapshots too
+    if (repair && num_snapshots() > 0)
+    {
+        printf("%s: ERROR: can not repair while there are snapshots, drop them first\n", cmd);
+        return;
+    }
+
+    struct fsck_state st;
+    memset(&st, 0, sizeof(st));
+    st.num_inodes = super->num_inodes < MAX_INODES ? super->num_inodes : MAX_INODES;
+    st.scrub = scrub;
+    st.refs = calloc(NUM_BLOCKS, sizeof(uint32_t));
+    st.links = calloc(st.num_inodes + 1, sizeof(uint32_t));
+    st.bad_at = malloc((st.num_inodes + 1) * sizeof(int32_t));
+    struct fsck_worker *workers = calloc(num_threads, sizeof(struct fsck_worker));
+
+    if (!st.refs || !st.links || !st.bad_at || !workers)
+    {
+        fprintf(stderr, "%s: ERROR: out of memory\n", cmd);
+        free(st.refs);
+        free(st.links);
+        free(st.bad_at);
+        free(workers);
+        return;
+    }
+
+    for (uint32_t inode = 0; inode < st.num_inodes; ++inode)
+        st.bad_at[inode] = -1;
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t shown = 0;
+    uint32_t problems = 0;
+
+    for (uint32_t g = 0; g < st.num_inodes / INODES_PER_BLOCK; ++g)
+    {
+        if (valid_data_block(inode_map[g]))
+        {
+            st.refs[inode_map[g]]++;
+        }
+        else
+        {
+            fsck_report(cmd, &shown, "inodes %u-%u are stored in block %d, outside the data area\n",
+                        g * INODES_PER_BLOCK, (g + 1) * INODES_PER_BLOCK - 1, inode_map[g]);
+            problems++;
+        }
+    }
+
+    for (long i = 0; i < num_threads; ++i)
+        workers[i].state = &st;
+    long ran = run_workers(fsck_run_worker, workers, sizeof(*workers), num_threads);
+
+    uint32_t blocks = 0;
+    for (long i = 0; i < ran; ++i)
+        blocks += workers[i].blocks;
+
+    // Problems the workers found along the way
+    char path[4096];
+    uint32_t damaged = 0;
+
+    for (long i = 0; i < ran; ++i)
+    {
+        for (uint32_t j = 0; j < workers[i].num_problems; ++j)
+        {
+            struct fsck_problem *p = &workers[i].problems[j];
+
+            if (p->kind == PROBLEM_RANGE && p->block == -1 && p->idx == BLOCKS_PER_FILE)
+            {
+                fsck_report(cmd, &shown, "inode %d is larger than the maximum file size\n",
+                            p->inode);
+            }
+            else if (p->kind == PROBLEM_RANGE)
+            {
+                fsck_report(cmd, &shown,
+                            "inode %d: block %d of the file is stored in block %d, outside the "
+                            "data area\n",
+                            p->inode, p->idx, p->block);
+            }
+            else if (p->kind == PROBLEM_DANGLING)
+            {
+                struct directoryEntry *entry = dirent_at(inode_at(p->inode), p->idx);
+                fsck_report(cmd, &shown, "`%.*s' in %s refers to missing inode %d\n", MAX_FILE_LEN,
+                            entry->filename, inode_path(p->inode, path, sizeof(path)), p->block);
+
+                if (repair)
+                {
+                    // Keep the name as a deleted entry so probing still
+                    // works, pointing at an inode that is always in use so
+                    // it can not be undeleted
+                    entry->in_use = 0;
+                    entry->inode = ROOT_INODE;
+                }
+            }
+            else
+            {
+                fsck_report(cmd, &shown, "checksum mismatch in block %d (block %d of %s)\n",
+                            p->block, p->idx, inode_path(p->inode, path, sizeof(path)));
+                damaged++;
+            }
+            problems++;
+        }
+        free(workers[i].problems);
+    }
+    free(workers);
+
+    // Files that could not be followed to the end. Directories have to be
+    // rehashed since their capacity changes
+    for (uint32_t inode = 0; repair && inode < st.num_inodes; ++inode)
+    {
+        int32_t keep = st.bad_at[inode];
+        if (keep == -1)
+            continue;
+
+        struct inode *node = inode_at(inode);
+        if (node->file_size > (uint32_t)keep * BLOCK_SIZE)
+            node->file_size = keep * BLOCK_SIZE;
+
+        for (int k = 0; k < NUM_INDIRECT; ++k)
+        {
+            if (keep <= NUM_DIRECT + k * PTRS_PER_BLOCK)
+                node->indirect[k] = -1;
+        }
+
+        if (node->type == INODE_DIR)
+            dir_rehash(inode, file_num_blocks(node));
+    }
+
+    // Blocks against the free block map. Runs of blocks with the same
+    // problem are reported together
+    uint32_t free_count = 0;
+    int run_kind = 0;
+    int32_t run_start = FIRST_DATA_BLOCK;
+
+    for (int32_t b = FIRST_DATA_BLOCK; b <= NUM_BLOCKS; ++b)
+    {
+        int kind = 0;
+
+        if (b < NUM_BLOCKS)
+        {
+            if (st.refs[b] > 1)
+            {
+                fsck_report(cmd, &shown, "block %d is used %u times\n", b, st.refs[b]);
+                problems++;
+            }
+            else if (st.refs[b] == 1 && free_blocks[b])
+                kind = 1;
+            else if (st.refs[b] == 0 && !free_blocks[b])
+                kind = 2;
+
+            if (st.refs[b] == 0 && !snap_refs[b])
+                free_count++;
+
+            if (repair)
+                free_blocks[b] = st.refs[b] == 0;
+        }
+
+        if (kind == run_kind)
+            continue;
+
+        if (run_kind)
+        {
+            bool one = (b - 1 == run_start);
+            const char *what = run_kind == 1 ? "in use but marked free"
+                               : one         ? "marked in use but nothing refers to it"
+                                             : "marked in use but nothing refers to them";
+            if (one)
+                fsck_report(cmd, &shown, "block %d is %s\n", run_start, what);
+            else
+                fsck_report(cmd, &shown, "blocks %d-%d are %s\n", run_start, b - 1, what);
+            problems += b - run_start;
+        }
+
+        run_kind = kind;
+        run_start = b;
+    }
+
+    // Inodes against the directories
+    uint32_t in_use = 0;
+    for (uint32_t inode = 0; inode < st.num_inodes; ++inode)
+    {
+        if (!inode_exists(inode, st.num_inodes))
+            continue;
+        in_use++;
+
+        if (inode == ROOT_INODE || st.links[inode] > 0)
+            continue;
+
+        fsck_report(cmd, &shown, "inode %u is not in any directory\n", inode);
+        problems++;
+    }
+
+    if (super->size_avail != free_count * BLOCK_SIZE)
+    {
+        fsck_report(cmd, &shown, "size_avail is %u bytes, should be %u\n", super->size_avail,
+                    free_count * BLOCK_SIZE);
+        problems++;
+    }
+
+    if (super->inodes_in_use != in_use)
+    {
+        fsck_report(cmd, &shown, "%u inodes are counted as in use, should be %u\n",
+                    super->inodes_in_use, in_use);
+        problems++;
+    }
+
+    if (repair)
+    {
+        uint8_t *kept = calloc(NUM_BLOCKS, 1);
+        if (kept == NULL)
+        {
+            fprintf(stderr, "%s: ERROR: out of memory, shared blocks were not copied\n", cmd);
+        }
+
+        for (uint32_t g = 0; kept && g < st.num_inodes / INODES_PER_BLOCK; ++g)
+        {
+            if (valid_data_block(inode_map[g]))
+                kept[inode_map[g]] = 1;
+        }
+
+        for (uint32_t inode = 0; inode < st.num_inodes; ++inode)
+        {
+            if (!inode_exists(inode, st.num_inodes))
+                continue;
+
+            struct inode *node = inode_at(inode);
+            int32_t num_blocks = file_num_blocks(node);
+
+            for (int32_t idx = 0; kept && idx < num_blocks; ++idx)
+            {
+                if (idx >= NUM_DIRECT && (idx - NUM_DIRECT) % PTRS_PER_BLOCK == 0)
+                    fsck_unshare(&node->indirect[(idx - NUM_DIRECT) / PTRS_PER_BLOCK], st.refs,
+                                 kept);
+                fsck_unshare(block_slot(node, idx, false), st.refs, kept);
+            }
+
+            if (inode != ROOT_INODE && st.links[inode] == 0)
+            {
+                char name[MAX_FILE_LEN + 1];
+                snprintf(name, sizeof(name), "#%u", inode);
+                if (dir_find(inode_at(ROOT_INODE), name, false) == -1 &&
+                    dir_add(ROOT_INODE, name, inode) != -1)
+                {
+                    node->parent = ROOT_INODE;
+                }
+            }
+        }
+        free(kept);
+
+        // Count again, the copies above took blocks
+        recount_free_space();
+        super->inodes_in_use = in_use;
+
+        // Sizes and entries changed under the list index
+        index_invalidate(-1);
+    }
+
+    if (shown > FSCK_MAX_REPORT)
+        printf("%s: ... and %u more\n", cmd, shown - FSCK_MAX_REPORT);
+
+    printf("%s: checked %u inodes and %u blocks in %lld ms using %ld thread%s\n", cmd, in_use,
+           blocks, (long long)elapsed_ms(&start), ran, ran > 1 ? "s" : "");
+
+    if (problems == 0)
+        printf("%s: no problems found\n", cmd);
+    else if (repair)
+        printf("%s: %u problems found and repaired%s\n", cmd, problems,
+               damaged ? " (damaged data blocks can not be repaired)" : "");
+    else
+        printf("%s: %u problems found, run fsck --repair to fix them\n", cmd, problems);
+
+    free(st.refs);
+    free(st.links);
+    free(st.bad_at);
+}
+
+// Check the consistency of the file system
+void fsck(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    check_image("fsck", tokens, false);
+}
+
+// Like fsck, but also read every data block and check it against its checksum
+void scrub(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    check_image("scrub", tokens, true);
+}
+
+#define GREP_MAX_PATTERN 256
+
+// Find the first place `pat' occurs in `hay', or NULL
+const uint8_t *find_bytes_sw(const uint8_t *hay, size_t len, const uint8_t *pat, size_t m)
+{
+    return memmem(hay, len, pat, m);
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+// The vector versions look for the first and the last byte of the pattern
+// at 16 (or 32) starting positions at once, and only compare the rest of
+// the pattern where both are found
+const uint8_t *find_bytes_sse2(const uint8_t *hay, size_t len, const uint8_t *pat, size_t m)
+{
+    if (m > len)
+        return NULL;
+    if (m == 1)
+        return memchr(hay, pat[0], len);
+
+    const __m128i first = _mm_set1_epi8(pat[0]);
+    const __m128i last = _mm_set1_epi8(pat[m - 1]);
+    size_t starts = len - m + 1;
+    size_t i = 0;
+
+    for (; i + 16 <= starts; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+        uint32_t mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if (!memcmp(hay + at + 1, pat + 1, m - 2))
+                return hay + at;
+        }
+    }
+
+    for (; i < starts; ++i)
+    {
+        if (hay[i] == pat[0] && !memcmp(hay + i + 1, pat + 1, m - 1))
+            return hay + i;
+    }
+    return NULL;
+}
+
+__attribute__((target("avx2"))) const uint8_t *find_bytes_avx2(const uint8_t *hay, size_t len,
+                                                                const uint8_t *pat, size_t m)
+{
+    if (m > len)
+        return NULL;
+    if (m == 1)
+        return memchr(hay, pat[0], len);
+
+    const __m256i first = _mm256_set1_epi8(pat[0]);
+    const __m256i last = _mm256_set1_epi8(pat[m - 1]);
+    size_t starts = len - m + 1;
+    size_t i = 0;
+
+    for (; i + 32 <= starts; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+        uint32_t mask = _mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+
+        for (; mask != 0; mask &= mask - 1)
+        {
+            size_t at = i + __builtin_ctz(mask);
+            if (!memcmp(hay + at + 1, pat + 1, m - 2))
+                return hay + at;
+        }
+    }
+
+    return find_bytes_sse2(hay + i, len - i, pat, m);
+}
+#endif
+
+const uint8_t *(*find_bytes)(const uint8_t *hay, size_t len, const uint8_t *pat,
+                             size_t m) = find_bytes_sw;
+
+void find_bytes_init(void)
+{
+#if defined(__x86_64__) && defined(__GNUC__)
+    find_bytes = __builtin_cpu_supports("avx2") ? find_bytes_avx2 : find_bytes_sse2;
+#endif
+}
+
+struct grep_file
+{
+    int32_t inode;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *offsets; // only kept when every match is printed
+};
+
+struct grep_state
+{
+    const uint8_t *pat;
+    size_t len;
+    bool keep_offsets;
+    bool first_only;
+    struct grep_file *files;
+    uint32_t num_files;
+    uint32_t next; // next file for a worker to take
+};
+
+// Returns false once no more matches are wanted from this file
+bool grep_match(struct grep_state *st, struct grep_file *f, uint32_t offset)
+{
+    if (st->keep_offsets && f->count == f->capacity)
+    {
+        uint32_t capacity = f->capacity ? f->capacity * 2 : 16;
+        uint32_t *offsets = realloc(f->offsets, capacity * sizeof(*offsets));
+        if (offsets == NULL)
+            return false;
+        f->offsets = offsets;
+        f->capacity = capacity;
+    }
+
+    if (st->keep_offsets)
+        f->offsets[f->count] = offset;
+    f->count++;
+    return !st->first_only;
+}
+
+// Report every match in `len' bytes at `data', which are at `base' in the
+// file. Matches may overlap
+bool grep_range(struct grep_state *st, struct grep_file *f, const uint8_t *data, size_t len,
+                uint32_t base)
+{
+    const uint8_t *p = data;
+    const uint8_t *hit;
+
+    while ((hit = find_bytes(p, data + len - p, st->pat, st->len)) != NULL)
+    {
+        if (!grep_match(st, f, base + (hit - data)))
+            return false;
+        p = hit + 1;
+    }
+    return true;
+}
+
+// Blocks that follow each other in the image are searched as one run. A
+// match that straddles two runs is found in a small buffer holding the
+// last len - 1 bytes of one run and the first len - 1 bytes of the next
+void grep_file(struct grep_state *st, struct grep_file *f)
+{
+    struct inode *node = inode_at(f->inode);
+    uint32_t size = node->file_size;
+    int32_t num_blocks = file_num_blocks(node);
+    size_t overlap = st->len - 1;
+    uint8_t seam[2 * GREP_MAX_PATTERN];
+    uint32_t pos = 0;
+
+    int32_t idx = 0;
+    int32_t block = checked_file_block(node, 0);
+
+    while (idx < num_blocks && block != -1)
+    {
+        int32_t end = idx + 1;
+        int32_t next;
+        while ((next = end < num_blocks ? checked_file_block(node, end) : -1) ==
+                   block + (end - idx) &&
+               next != -1)
+            ++end;
+
+        uint32_t run_end = (uint32_t)end * BLOCK_SIZE < size ? (uint32_t)end * BLOCK_SIZE : size;
+        const uint8_t *run = curr_image[block];
+        if (!grep_range(st, f, run, run_end - pos, pos))
+            return;
+
+        // Only the last run can be shorter than a block, so there is
+        // always enough on the left of the seam
+        if (next != -1 && overlap > 0)
+        {
+            size_t right = size - run_end < overlap ? size - run_end : overlap;
+            memcpy(seam, run + (run_end - pos) - overlap, overlap);
+            memcpy(seam + overlap, curr_image[next], right);
+            if (!grep_range(st, f, seam, overlap + right, run_end - overlap))
+                return;
+        }
+
+        pos = run_end;
+        idx = end;
+        block = next;
+    }
+}
+
+void *grep_run_worker(void *arg)
+{
+    struct grep_state *st = arg;
+
+    for (;;)
+    {
+        uint32_t i = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED);
+        if (i >= st->num_files)
+            break;
+        grep_file(st, &st->files[i]);
+    }
+    return NULL;
+}
+
+bool grep_add(struct grep_state *st, uint32_t *capacity, int32_t inode)
+{
+    if (st->num_files == *capacity)
+    {
+        uint32_t n = *capacity ? *capacity * 2 : 64;
+        struct grep_file *files = realloc(st->files, n * sizeof(*files));
+        if (files == NULL)
+            return false;
+        st->files = files;
+        *capacity = n;
+    }
+
+    memset(&st->files[st->num_files], 0, sizeof(struct grep_file));
+    st->files[st->num_files++].inode = inode;
+    return true;
+}
+
+// Add the files in `dir' and all of its subdirectories
+bool grep_add_dir(struct grep_state *st, uint32_t *capacity, int32_t dir)
+{
+    struct inode *node = inode_at(dir);
+
+    for (int32_t idx = 0; idx < file_num_blocks(node); ++idx)
+    {
+        struct directoryEntry *entry = (struct directoryEntry *)curr_image[file_block(node, idx)];
+
+        for (int i = 0; i < DIRENTS_PER_BLOCK; ++i)
+        {
+            if (!entry[i].in_use)
+                continue;
+
+            bool ok = is_dir(entry[i].inode) ? grep_add_dir(st, capacity, entry[i].inode)
+                                             : grep_add(st, capacity, entry[i].inode);
+            if (!ok)
+                return false;
+        }
+    }
+    return true;
+}
+
+// Turn a string of hex digits into bytes. Returns the number of bytes, or
+// -1 if it is not valid
+int parse_hex(const char *hex, uint8_t *out, size_t size)
+{
+    size_t n = strlen(hex);
+    if (n == 0 || n % 2 || n / 2 > size)
+        return -1;
+
+    for (size_t i = 0; i < n; i += 2)
+    {
+        unsigned int byte;
+        if (!isxdigit((unsigned char)hex[i]) || !isxdigit((unsigned char)hex[i + 1]) ||
+            sscanf(hex + i, "%2x", &byte) != 1)
+            return -1;
+        out[i / 2] = byte;
+    }
+    return n / 2;
+}
+
+// Search the data of files for a string of bytes, given as text or with
+// -x as hex digits. Without file names every file in the image is
+// searched, and a directory stands for all of the files below it. Prints
+// <file>:<offset> for each match, <file>:<count> for each file with -c, or
+// just the names of the files that match with -l
+void grep(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("grep: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    bool count_only = take_option(tokens, "-c");
+    bool names_only = take_option(tokens, "-l");
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    uint8_t pat[GREP_MAX_PATTERN];
+    int len = -1;
+    char *paths[MAX_NUM_ARGUMENTS];
+    int num_paths = 0;
+
+    for (int i = 1; i < MAX_NUM_ARGUMENTS && tokens[i] != NULL; ++i)
+    {
+        if (!strcmp(tokens[i], "-x") || !strcmp(tokens[i], "-j"))
+        {
+            if (i + 1 >= MAX_NUM_ARGUMENTS || tokens[i + 1] == NULL)
+            {
+                fprintf(stderr, "grep: ERROR: %s expects a value\n", tokens[i]);
+                return;
+            }
+
+            if (tokens[i][1] == 'j')
+                num_threads = atol(tokens[++i]);
+            else if ((len = parse_hex(tokens[++i], pat, sizeof(pat))) == -1)
+            {
+                fprintf(stderr, "grep: ERROR: `%s' is not a pattern of up to %d hex bytes\n",
+                        tokens[i], GREP_MAX_PATTERN);
+                return;
+            }
+        }
+        else if (len == -1)
+        {
+            len = strlen(tokens[i]);
+            if (len == 0 || len > GREP_MAX_PATTERN)
+            {
+                fprintf(stderr, "grep: ERROR: the pattern should be 1 to %d bytes long\n",
+                        GREP_MAX_PATTERN);
+                return;
+            }
+            memcpy(pat, tokens[i], len);
+        }
+        else
+            paths[num_paths++] = tokens[i];
+    }
+
+    if (len == -1)
+    {
+        fprintf(stderr, "grep: ERROR: no pattern given\n");
+        return;
+    }
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_WORKERS)
+        num_threads = MAX_WORKERS;
+
+    struct grep_state st;
+    memset(&st, 0, sizeof(st));
+    st.pat = pat;
+    st.len = len;
+    st.keep_offsets = !count_only && !names_only;
+    st.first_only = names_only;
+
+    uint32_t capacity = 0;
+    bool ok = true;
+
+    if (num_paths == 0)
+        ok = grep_add_dir(&st, &capacity, ROOT_INODE);
+
+    for (int i = 0; ok && i < num_paths; ++i)
+    {
+        int32_t inode = lookup(paths[i], NULL, NULL);
+        if (inode == -1)
+            printf("grep: ERROR: `%s' not found\n", paths[i]);
+        else if (is_dir(inode))
+            ok = grep_add_dir(&st, &capacity, inode);
+        else
+            ok = grep_add(&st, &capacity, inode);
+    }
+
+    if (!ok)
+    {
+        fprintf(stderr, "grep: ERROR: out of memory\n");
+        free(st.files);
+        return;
+    }
+
+    if (num_threads > st.num_files)
+        num_threads = st.num_files ? st.num_files : 1;
+
+    run_workers(grep_run_worker, &st, 0, num_threads);
+
+    char path[4096];
+    for (uint32_t i = 0; i < st.num_files; ++i)
+    {
+        struct grep_file *f = &st.files[i];
+
+        if (count_only)
+            printf("%s:%u\n", inode_path(f->inode, path, sizeof(path)), f->count);
+        else if (names_only && f->count > 0)
+            printf("%s\n", inode_path(f->inode, path, sizeof(path)));
+        else if (f->count > 0)
+        {
+            char *name = inode_path(f->inode, path, sizeof(path));
+            for (uint32_t j = 0; j < f->count; ++j)
+                printf("%s:%u\n", name, f->offsets[j]);
+        }
+        free(f->offsets);
+    }
+    free(st.files);
+}
+
+// The manifest `sync' keeps in the host directory: one line per file with
+// the generation, size and inode it was exported with, then its path
+#define SYNC_MANIFEST ".mfs-sync"
+
+struct sync_file
+{
+    char *path; // relative to the root of the image and to the host directory
+    uint32_t generation;
+    uint32_t size;
+    int32_t inode;
+    bool failed;
+};
+
+struct sync_state
+{
+    const char *hostdir;
+    struct sync_file *files;
+    uint32_t num_files;
+    uint32_t capacity;
+    uint32_t *todo; // files to export
+    uint32_t num_todo;
+    uint32_t next; // next entry of `todo' for a worker to take
+};
+
+int sync_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct sync_file *)a)->path, ((const struct sync_file *)b)->path);
+}
+
+struct sync_file *sync_find(struct sync_file *files, uint32_t n, const char *path)
+{
+    if (n == 0)
+        return NULL;
+
+    struct sync_file key = {.path = (char *)path};
+    return bsearch(&key, files, n, sizeof(key), sync_compare);
+}
+
+bool sync_add(struct sync_file **files, uint32_t *n, uint32_t *capacity, const char *path,
+              uint32_t generation, uint32_t size, int32_t inode)
+{
+    if (*n == *capacity)
+    {
+        uint32_t c = *capacity ? *capacity * 2 : 64;
+        struct sync_file *grown = realloc(*files, c * sizeof(*grown));
+        if (grown == NULL)
+            return false;
+        *files = grown;
+        *capacity = c;
+    }
+
+    struct sync_file *f = &(*files)[*n];
+    if ((f->path = strdup(path)) == NULL)
+        return false;
+    f->generation = generation;
+    f->size = size;
+    f->inode = inode;
+    f->failed = false;
+    (*n)++;
+    return true;
+}
+
+// Add the files below `dir', whose path is `prefix', and make the same
+// directories in the host directory
+bool sync_add_dir(struct sync_state *st, int32_t dir, const char *prefix)
+{
+    struct inode *node = inode_at(dir);
+    char path[PATH_MAX];
+
+    for (int32_t idx = 0; idx < file_num_blocks(node); ++idx)
+    {
+        struct directoryEntry *entry = (struct directoryEntry *)curr_image[file_block(node, idx)];
+
+        for (int i = 0; i < DIRENTS_PER_BLOCK; ++i)
+        {
+            if (!entry[i].in_use)
+                continue;
+
+            int len = snprintf(path, sizeof(path), "%s%s%.*s", prefix, *prefix ? "/" : "",
+                               MAX_FILE_LEN, entry[i].filename);
+            if (len >= sizeof(path))
+                continue;
+
+            struct inode *child = inode_at(entry[i].inode);
+            if (child->type == INODE_DIR)
+            {
+                char host[PATH_MAX];
+                if (snprintf(host, sizeof(host), "%s/%s", st->hostdir, path) < sizeof(host))
+                    mkdir(host, 0777);
+                if (!sync_add_dir(st, entry[i].inode, path))
+                    return false;
+            }
+            else if (!sync_add(&st->files, &st->num_files, &st->capacity, path, child->generation,
+                               child->file_size, entry[i].inode))
+                return false;
+        }
+    }
+    return true;
+}
+
+// Write one file to a temporary name next to its place, then rename it, so
+// other tools never see it half written. Damaged blocks fail the export
+// and leave the old copy alone
+bool sync_export(struct sync_state *st, struct sync_file *f)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/%s", st->hostdir, f->path);
+    if (snprintf(tmp, sizeof(tmp), "%s.mfs-sync-tmp", path) >= sizeof(tmp))
+        return false;
+
+    struct inode *node = inode_at(f->inode);
+    struct io_req reqs[BLOCKS_PER_FILE];
+    int num_reqs = 0;
+
+    for (int32_t idx = 0; idx < file_num_blocks(node); ++idx)
+    {
+        int32_t block = checked_file_block(node, idx);
+        if (block == -1 || checksums[block] != block_crc(block))
+            return false;
+
+        uint32_t len = f->size - (uint32_t)idx * BLOCK_SIZE;
+        num_reqs = io_add(reqs, num_reqs, block, len < BLOCK_SIZE ? len : BLOCK_SIZE,
+                          (off_t)idx * BLOCK_SIZE);
+    }
+
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1)
+        return false;
+
+    bool ok = true;
+    for (int i = 0; i < num_reqs && ok; ++i)
+    {
+        io_sync(fd, true, &reqs[i]);
+        ok = reqs[i].done == reqs[i].len;
+    }
+
+    if (close(fd) == -1 || !ok || rename(tmp, path) == -1)
+    {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+void *sync_run_worker(void *arg)
+{
+    struct sync_state *st = arg;
+
+    for (;;)
+    {
+        uint32_t i = __atomic_fetch_add(&st->next, 1, __ATOMIC_RELAXED);
+        if (i >= st->num_todo)
+            break;
+
+        struct sync_file *f = &st->files[st->todo[i]];
+        f->failed = !sync_export(st, f);
+    }
+    return NULL;
+}
+
+// Remove `path' from the host directory, and the directories holding it
+// that are now empty
+void sync_remove(const char *hostdir, const char *path)
+{
+    char host[PATH_MAX];
+    if (snprintf(host, sizeof(host), "%s/%s", hostdir, path) >= sizeof(host))
+        return;
+
+    if (unlink(host) == -1)
+        return;
+
+    size_t root = strlen(hostdir);
+    char *slash;
+    while ((slash = strrchr(host, '/')) != NULL && slash - host > root)
+    {
+        *slash = '\0';
+        if (rmdir(host) == -1)
+            break;
+    }
+}
+
+void sync_free(struct sync_file *files, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; ++i)
+        free(files[i].path);
+    free(files);
+}
+
+// Mirror the files of the image into a directory on the host. Only files
+// whose generation or size differ from the manifest left there by the last
+// sync are exported, on several threads. With --delete, files that are no
+// longer in the image are removed from the host directory too
+void sync_dir(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("sync: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    bool delete = take_option(tokens, "--delete");
+    long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    char *jobs;
+
+    // Like the other options, -j can come before or after the directory
+    if (take_value(tokens, "-j", &jobs))
+    {
+        uint32_t n;
+        if (jobs == NULL)
+        {
+            fprintf(stderr, "sync: ERROR: -j expects a number of threads\n");
+            return;
+        }
+        if (!parse_number("sync", jobs, &n))
+            return;
+        num_threads = n;
+    }
+
+    if (tokens[1] != NULL && tokens[2] != NULL)
+    {
+        fprintf(stderr, "sync: unrecognized option %s\n", tokens[2]);
+        return;
+    }
+
+    if (tokens[1] == NULL)
+    {
+        fprintf(stderr, "sync: Not enough arguments\n");
+        return;
+    }
+
+    if (num_threads < 1)
+        num_threads = 1;
+    if (num_threads > MAX_WORKERS)
+        num_threads = MAX_WORKERS;
+
+    struct sync_state st;
+    memset(&st, 0, sizeof(st));
+    st.hostdir = tokens[1];
+
+    struct stat buf;
+    if (mkdir(st.hostdir, 0777) == -1 && (stat(st.hostdir, &buf) == -1 || !S_ISDIR(buf.st_mode)))
+    {
+        printf("sync: ERROR: `%s' is not a directory\n", st.hostdir);
+        return;
+    }
+
+    // What the last sync exported
+    char manifest[PATH_MAX], tmp[PATH_MAX];
+    if (snprintf(manifest, sizeof(manifest), "%s/%s", st.hostdir, SYNC_MANIFEST) >= sizeof(manifest) ||
+        snprintf(tmp, sizeof(tmp), "%s.tmp", manifest) >= sizeof(tmp))
+    {
+        printf("sync: ERROR: `%s' is too long\n", st.hostdir);
+        return;
+    }
+
+    struct sync_file *old = NULL;
+    uint32_t num_old = 0, old_capacity = 0;
+    bool ok = true;
+
+    FILE *fp = fopen(manifest, "r");
+    if (fp != NULL)
+    {
+        char path[PATH_MAX];
+        uint32_t generation, size;
+        int32_t inode;
+
+        while (ok && fscanf(fp, "%u %u %d %4095[^\n]\n", &generation, &size, &inode, path) == 4)
+            ok = sync_add(&old, &num_old, &old_capacity, path, generation, size, inode);
+        fclose(fp);
+        qsort(old, num_old, sizeof(*old), sync_compare);
+    }
+
+    ok = ok && sync_add_dir(&st, ROOT_INODE, "");
+    if (ok)
+        st.todo = malloc((st.num_files + 1) * sizeof(uint32_t));
+    if (!ok || st.todo == NULL)
+    {
+        fprintf(stderr, "sync: ERROR: out of memory\n");
+        sync_free(old, num_old);
+        sync_free(st.files, st.num_files);
+        free(st.todo);
+        return;
+    }
+    qsort(st.files, st.num_files, sizeof(*st.files), sync_compare);
+
+    for (uint32_t i = 0; i < st.num_files; ++i)
+    {
+        struct sync_file *f = &st.files[i];
+        struct sync_file *prev = sync_find(old, num_old, f->path);
+        if (prev == NULL || prev->generation != f->generation || prev->size != f->size ||
+            prev->inode != f->inode)
+            st.todo[st.num_todo++] = i;
+    }
+
+    if (num_threads > st.num_todo)
+        num_threads = st.num_todo ? st.num_todo : 1;
+
+    run_workers(sync_run_worker, &st, 0, num_threads);
+
+    uint32_t exported = 0, failed = 0, deleted = 0;
+    uint64_t bytes = 0;
+
+    for (uint32_t i = 0; i < st.num_todo; ++i)
+    {
+        struct sync_file *f = &st.files[st.todo[i]];
+        if (f->failed)
+        {
+            printf("sync: ERROR: could not export `%s'\n", f->path);
+            failed++;
+        }
+        else
+        {
+            exported++;
+            bytes += f->size;
+        }
+    }
+
+    // The new manifest. A file that could not be exported keeps its old
+    // line, so the next sync tries again. Without --delete the lines of
+    // files that are gone are kept as well, for a later sync --delete
+    fp = fopen(tmp, "w");
+    if (fp == NULL)
+    {
+        printf("sync: ERROR: could not write `%s'\n", tmp);
+        sync_free(old, num_old);
+        sync_free(st.files, st.num_files);
+        free(st.todo);
+        return;
+    }
+
+    for (uint32_t i = 0; i < st.num_files; ++i)
+    {
+        struct sync_file *f = st.files[i].failed ? sync_find(old, num_old, st.files[i].path)
+                                                 : &st.files[i];
+        if (f != NULL)
+            fprintf(fp, "%u %u %d %s\n", f->generation, f->size, f->inode, f->path);
+    }
+
+    for (uint32_t i = 0; i < num_old; ++i)
+    {
+        if (sync_find(st.files, st.num_files, old[i].path) != NULL)
+            continue;
+
+        if (delete)
+        {
+            sync_remove(st.hostdir, old[i].path);
+            deleted++;
+        }
+        else
+            fprintf(fp, "%u %u %d %s\n", old[i].generation, old[i].size, old[i].inode,
+                    old[i].path);
+    }
+
+    if (fclose(fp) == EOF || rename(tmp, manifest) == -1)
+        printf("sync: ERROR: could not write `%s'\n", manifest);
+
+    printf("sync: %u files exported (%llu bytes), %u unchanged, %u deleted\n", exported,
+           (unsigned long long)bytes, st.num_files - st.num_todo, deleted);
+    if (failed)
+        printf("sync: ERROR: %u files could not be exported\n", failed);
+
+    sync_free(old, num_old);
+    sync_free(st.files, st.num_files);
+    free(st.todo);
+}
+
+///////////////////////////////////////
+// Snapshots
+//////////////////////////////////////
+
+// Block that holds group `g' of the inode table, in the live file system
+// when `snap' is NULL, otherwise as it was when the snapshot was taken
+int32_t group_block(const struct snapshot *snap, uint32_t g)
+{
+    if (snap == NULL)
+        return inode_map[g];
+
+    int32_t map = snap->map[g / PTRS_PER_BLOCK];
+    return valid_data_block(map) ? ((int32_t *)curr_image[map])[g % PTRS_PER_BLOCK] : -1;
+}
+
+// Call `visit' for every block of a file system tree (the live one when
+// `snap' is NULL): the inode table and all blocks of the inodes in use
+void for_each_tree_block(const struct snapshot *snap, void (*visit)(int32_t block, void *arg),
+                         void *arg)
+{
+    uint32_t num_inodes = snap ? snap->num_inodes : super->num_inodes;
+    if (num_inodes > MAX_INODES)
+        num_inodes = MAX_INODES;
+
+    for (uint32_t g = 0; g < num_inodes / INODES_PER_BLOCK; ++g)
+    {
+        int32_t group = group_block(snap, g);
+        if (!valid_data_block(group))
+            continue;
+        visit(group, arg);
+
+        struct inode *nodes = (struct inode *)curr_image[group];
+        for (int i = 0; i < INODES_PER_BLOCK; ++i)
+        {
+            struct inode *node = &nodes[i];
+            if (!node->in_use)
+                continue;
+
+            int32_t num_blocks = file_num_blocks(node);
+            if (num_blocks > BLOCKS_PER_FILE)
+                num_blocks = BLOCKS_PER_FILE;
+
+            for (int k = 0; k < NUM_INDIRECT && num_blocks > NUM_DIRECT + k * PTRS_PER_BLOCK; ++k)
+            {
+                if (valid_data_block(node->indirect[k]))
+                    visit(node->indirect[k], arg);
+            }
+
+            for (int32_t idx = 0; idx < num_blocks; ++idx)
+            {
+                int32_t block = checked_file_block(node, idx);
+                if (block != -1)
+                    visit(block, arg);
+            }
+        }
+    }
+}
+
+void snapshot_hold(int32_t block, void *arg)
+{
+    snap_refs[block]++;
+}
+
+void snapshot_release(int32_t block, void *arg)
+{
+    if (snap_refs[block])
+        snap_refs[block]--;
+}
+
+void live_release(int32_t block, void *arg)
+{
+    free_blocks[block] = 1;
+}
+
+void live_take(int32_t block, void *arg)
+{
+    free_blocks[block] = 0;
+}
+
+// Blocks that dropping the snapshot would give back
+void count_own(int32_t block, void *arg)
+{
+    if (free_blocks[block] && snap_refs[block] == 1)
+        (*(uint32_t *)arg)++;
+}
+
+struct snapshot *find_snapshot(const char *name)
+{
+    for (int i = 0; i < MAX_SNAPSHOTS; ++i)
+    {
+        if (snapshots[i].in_use && !strncmp(snapshots[i].name, name, MAX_FILE_LEN))
+            return &snapshots[i];
+    }
+    return NULL;
+}
+
+// Taking a snapshot copies only the inode map. Everything below it is
+// shared, and every block of the tree gets one more reference
+void snapshot_create(const char *name)
+{
+    struct snapshot *snap = NULL;
+    for (int i = 0; i < MAX_SNAPSHOTS && snap == NULL; ++i)
+    {
+        if (!snapshots[i].in_use)
+            snap = &snapshots[i];
+    }
+
+    if (snap == NULL)
+    {
+        printf("snapshot: ERROR: there are already %d snapshots.\n", MAX_SNAPSHOTS);
+        return;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint32_t groups = super->num_inodes / INODES_PER_BLOCK;
+    int num_map = (groups + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+
+    memset(snap, 0, sizeof(*snap));
+    memset(snap->map, -1, sizeof(snap->map));
+
+    for (int k = 0; k < num_map; ++k)
+    {
+        if ((snap->map[k] = findFreeBlock()) == -1)
+        {
+            while (k-- > 0)
+                releaseBlock(snap->map[k]);
+            printf("snapshot: ERROR: no free block found.\n");
+            return;
+        }
+        memcpy(curr_image[snap->map[k]], &inode_map[k * PTRS_PER_BLOCK], BLOCK_SIZE);
+    }
+
+    // The tree is frozen from here on, so its checksums have to be current
+    for_each_metadata_block(refresh_checksum, NULL);
+
+    // The map blocks belong to the snapshot alone
+    for (int k = 0; k < num_map; ++k)
+    {
+        update_checksum(snap->map[k]);
+        free_blocks[snap->map[k]] = 1;
+        snap_refs[snap->map[k]] = 1;
+    }
+
+    strncpy(snap->name, name, MAX_FILE_LEN - 1);
+    snap->created = time(NULL);
+    snap->num_inodes = super->num_inodes;
+    snap->inodes_in_use = super->inodes_in_use;
+    snap->inode_hint = super->inode_hint;
+    snap->in_use = 1;
+
+    for_each_tree_block(snap, snapshot_hold, NULL);
+
+    printf("snapshot: created `%s' in %lld ms\n", snap->name, (long long)elapsed_ms(&start));
+}
+
+void snapshot_drop(struct snapshot *snap)
+{
+    for_each_tree_block(snap, snapshot_release, NULL);
+
+    for (int k = 0; k < SNAPSHOT_MAP_BLOCKS; ++k)
+    {
+        if (valid_data_block(snap->map[k]))
+            snap_refs[snap->map[k]] = 0;
+    }
+
+    memset(snap, 0, sizeof(*snap));
+    recount_free_space();
+}
+
+// Make the snapshot the live file system again. Whatever the live file
+// system had that the snapshot does not becomes free. The snapshot stays,
+// and the two share all of their blocks until they are changed again
+void snapshot_restore(struct snapshot *snap)
+{
+    for_each_tree_block(NULL, live_release, NULL);
+
+    uint32_t groups = snap->num_inodes / INODES_PER_BLOCK;
+    for (uint32_t g = 0; g < MAX_INODES / INODES_PER_BLOCK; ++g)
+        inode_map[g] = g < groups ? group_block(snap, g) : -1;
+
+    super->num_inodes = snap->num_inodes;
+    super->inodes_in_use = snap->inodes_in_use;
+    super->inode_hint = snap->inode_hint;
+
+    for_each_tree_block(NULL, live_take, NULL);
+    recount_free_space();
+
+    cwd = ROOT_INODE;
+    index_invalidate(-1);
+}
+
+void snapshot_list(void)
+{
+    bool any = false;
+
+    for (int i = 0; i < MAX_SNAPSHOTS; ++i)
+    {
+        struct snapshot *snap = &snapshots[i];
+        if (!snap->in_use)
+            continue;
+
+        uint32_t own = 0;
+        for_each_tree_block(snap, count_own, &own);
+        for (int k = 0; k < SNAPSHOT_MAP_BLOCKS; ++k)
+            own += valid_data_block(snap->map[k]);
+
+        char created[32];
+        time_t when = snap->created;
+        strftime(created, sizeof(created), "%Y-%m-%d %H:%M:%S", localtime(&when));
+
+        printf("%-20s %s %8u inodes %10u bytes held\n", snap->name, created, snap->inodes_in_use,
+               own * BLOCK_SIZE);
+        any = true;
+    }
+
+    if (!any)
+        printf("snapshot: No snapshots found.\n");
+}
+
+// Create, list, restore and drop named snapshots of the file system
+void snapshot(char *tokens[MAX_NUM_ARGUMENTS])
+{
+    if (!image_open)
+    {
+        printf("snapshot: ERROR: Disk image not open.\n");
+        return;
+    }
+
+    char *action = tokens[1];
+    char *name = tokens[2];
+
+    if (!strcmp(action, "list"))
+    {
+        snapshot_list();
+        return;
+    }
+
+    if (strcmp(action, "create") && strcmp(action, "restore") && strcmp(action, "drop"))
+    {
+        fprintf(stderr, "snapshot: unrecognized action %s\n", action);
+        return;
+    }
+
+    if (name == NULL || name[0] == '\0' || strlen(name) >= MAX_FILE_LEN)
+    {
+        printf("snapshot: ERROR: %s expects a name of at most %d characters\n", action,
+               MAX_FILE_LEN - 1);
+        return;
+    }
+
+    if (!image_writable("snapshot"))
+        return;
+
+    struct snapshot *snap = find_snapshot(name);
+
+    if (!strcmp(action, "create"))
+    {
+        if (snap != NULL)
+            printf("snapshot: ERROR: `%s' already exists.\n", name);
+        else
+            snapshot_create(name);
+        return;
+    }
+
+    if (snap == NULL)
+    {
+        printf("snapshot: ERROR: no snapshot named `%s'.\n", name);
+        return;
+    }
+
+    if (!strcmp(action, "restore"))
+        snapshot_restore(snap);
+    else
+        snapshot_drop(snap);
+}
+
+///////////////////////////////////////
+// Tracing and replay
+//////////////////////////////////////
+
+// `mfs --trace file' records every command in a binary trace: a
+// trace_header followed by one trace_record per command, each followed by
+// its arguments as NUL terminated strings. Numbers are in the byte order
+// of the machine that recorded them. `mfs --replay file' runs a trace
+// again and reports how long each kind of command took
+#define TRACE_MAGIC "MFSTRACE"
+#define TRACE_VERSION 1
+
+// Result codes. Commands do not return a status, so a command counts as
+// failed if it printed an error: anything on stderr other than a warning,
+// or "ERROR" on stdout
+#define RESULT_OK 0
+#define RESULT_ERROR 1
+#define RESULT_INVALID 2 // unknown command or missing arguments
+
+struct trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+    int64_t started; // wall clock time the trace began
+};
+
+struct trace_record
+{
+    uint64_t start_ns;    // since the trace began
+    uint64_t duration_ns;
+    int64_t input_size;   // bytes read from a host file, or -1
+    uint8_t result;
+    uint8_t num_args;     // including the command name
+    uint16_t args_len;    // bytes of arguments that follow
+};
+
+// The record is written without its tail padding
+#define TRACE_RECORD_SIZE (offsetof(struct trace_record, args_len) + sizeof(uint16_t))
+#define TRACE_MAX_ARGS_LEN (MAX_NUM_ARGUMENTS * (MAX_COMMAND_SIZE + 1))
+
+FILE *trace_fp;
+int64_t trace_start_ns;
+
+// While tracing or replaying, stdout and stderr go through watch_write so
+// that errors can be noticed. During a replay the output is also dropped
+bool watching;
+bool output_muted;
+bool command_failed;
+
+int64_t now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+ssize_t watch_write(void *cookie, const char *buf, size_t size)
+{
+    int fd = (intptr_t)cookie;
+
+    if (fd == STDERR_FILENO ? memmem(buf, size, "WARNING", 7) == NULL
+                            : memmem(buf, size, "ERROR", 5) != NULL)
+    {
+        command_failed = true;
+    }
+
+    for (size_t done = 0; !output_muted && done < size;)
+    {
+        ssize_t bytes = write(fd, buf + done, size - done);
+        if (bytes == -1 && errno != EINTR)
+            break;
+        if (bytes > 0)
+            done += bytes;
+    }
+    return size;
+}
+
+void watch_output(bool mute)
+{
+    cookie_io_functions_t io = {.write = watch_write};
+
+    fflush(stdout);
+    fflush(stderr);
+    stdout = fopencookie((void *)(intptr_t)STDOUT_FILENO, "w", io);
+    stderr = fopencookie((void *)(intptr_t)STDERR_FILENO, "w", io);
+    setvbuf(stdout, NULL, _IOFBF, 1 << 16);
+    setvbuf(stderr, NULL, _IONBF, 0);
+
+    watching = true;
+    output_muted = mute;
+}
+
+const command *find_command(const char *name);
+
+// Look up and run one command. Returns its result code
+// Images open --shared are locked against saves while a command runs. If
+// another process saved one since the last command, it is mapped again and
+// its lookup indexes are dropped; the current directory is kept if it is
+// still there
+void shared_begin(void)
+{
+    int prev = curr_slot;
+
+    for (int i = 0; i < MAX_IMAGES; ++i)
+    {
+        struct image *img = &images[i];
+        if (img->mode != OPEN_SHARED || (i != curr_slot && !img->open))
+            continue;
+
+        lock_image(img->fd, LOCK_DATA, F_RDLCK, true);
+        if (((struct superblock *)img->map[SUPERBLOCK])->generation == img->generation)
+            continue;
+
+        select_image(i);
+        if (map_image_file(img) == -1)
+            fprintf(stderr, "mfs: ERROR: could not map `%s' again\n", image_name);
+        view_image();
+        index_invalidate(-1);
+        img->generation = super->generation;
+
+        if (!inode_exists(cwd, super->num_inodes) || !is_dir(cwd))
+            cwd = ROOT_INODE;
     }
 
-    if (empty)
+    select_image(prev);
+}
+
+void shared_end(void)
+{
+    for (int i = 0; i < MAX_IMAGES; ++i)
     {
-        printf("list: No files found.\n");
+        if (images[i].mode == OPEN_SHARED)
+            lock_image(images[i].fd, LOCK_DATA, F_UNLCK, false);
     }
 }
 
-// Outputs the amount of free space left on the disk image
-// using global size variable
-void df(char *tokens[MAX_NUM_ARGUMENTS])
+int run_command(char *tokens[MAX_NUM_ARGUMENTS])
 {
-    if (!image_open)
+    const command *found = find_command(tokens[0]);
+
+    if (found == NULL)
     {
-        printf("ERROR: Disk Image not opened.\n");
-        return;
+        fprintf(stderr, "mfs: Invalid command `%s'\n", tokens[0]);
+        return RESULT_INVALID;
+    }
+    if (tokens[found->num_args] == NULL)
+    {
+        fprintf(stderr, "%s: Not enough arguments\n", tokens[0]);
+        return RESULT_INVALID;
     }
 
-    printf("%d bytes free.\n", size_avail);
+    if (found->modifies && image_open && !image_writable(tokens[0]))
+        return RESULT_ERROR;
+
+    command_failed = false;
+    shared_begin();
+    found->run(tokens);
+    shared_end();
+
+    // Push the output through watch_write while it still belongs to this
+    // command
+    if (watching)
+        fflush(stdout);
+    return command_failed ? RESULT_ERROR : RESULT_OK;
 }
 
-// opens a previously created file system
-// reads whats currently in the image into the FILE* fp
-// set the image to open
-void openfs(char *tokens[MAX_NUM_ARGUMENTS])
+// Index of the `n'th argument that is not an option, or -1. The key after
+// --xor belongs to the option
+int host_arg(char *tokens[MAX_NUM_ARGUMENTS], int n)
 {
-    int max_size = sizeof(image_name) - 1;
-    if (strlen(tokens[1]) > max_size)
+    for (int i = 1; i < MAX_NUM_ARGUMENTS && tokens[i] != NULL; ++i)
     {
-        fprintf(stderr, "Image name should not be longer than %d characters\n", max_size);
+        if (!strcmp(tokens[i], "--xor") && i + 1 < MAX_NUM_ARGUMENTS && tokens[i + 1] != NULL)
+            ++i;
+        else if (strncmp(tokens[i], "--", 2) && --n == 0)
+            return i;
     }
+    return -1;
+}
 
-    FILE *fp = fopen(tokens[1], "r");
-    if (fp == NULL)
+// Which argument of a command names a host file it reads, and which one a
+// host file it writes (0 for none)
+void host_files(const char *cmd, int *input, int *output)
+{
+    *input = *output = 0;
+
+    if (!strcmp(cmd, "insert"))
+        *input = 1;
+    else if (!strcmp(cmd, "append"))
+        *input = 2;
+    else if (!strcmp(cmd, "write"))
+        *input = 3;
+    else if (!strcmp(cmd, "retrieve") || !strcmp(cmd, "savefs") || !strcmp(cmd, "createfs"))
+        *output = !strcmp(cmd, "retrieve") ? 2 : 1;
+}
+
+void trace_begin(const char *path)
+{
+    if ((trace_fp = fopen(path, "w")) == NULL)
     {
-        fprintf(stderr, "Error opening file\n");
-        return;
+        fprintf(stderr, "mfs: ERROR: could not open trace file `%s'\n", path);
+        exit(1);
     }
+    setvbuf(trace_fp, NULL, _IOFBF, 1 << 16);
 
-    strncpy(image_name, tokens[1], max_size);
-    int read = fread(&curr_image[0][0], BLOCK_SIZE, NUM_BLOCKS, fp);
-    printf("Read %d blocks from %s\n", read, tokens[1]);
+    struct trace_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.started = time(NULL);
+    fwrite(&header, sizeof(header), 1, trace_fp);
 
-    image_open = 1;
-    fclose(fp);
+    trace_start_ns = now_ns();
+    watch_output(false);
 }
 
-// closes disk image if it is open
-void closefs(char *tokens[MAX_NUM_ARGUMENTS])
+// Run a command and append it to the trace
+void trace_command(char *tokens[MAX_NUM_ARGUMENTS])
 {
-    if (image_open == 0)
+    struct trace_record rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.input_size = -1;
+
+    int input, output;
+    host_files(tokens[0], &input, &output);
+    int arg = input ? host_arg(tokens, input) : -1;
+
+    struct stat buf;
+    bool from_stdin = arg != -1 && !strcmp(tokens[arg], "-");
+    if (arg != -1 && !from_stdin && stat(tokens[arg], &buf) == 0)
+        rec.input_size = buf.st_size;
+
+    // Arguments are saved first, the command may take options out
+    char args[TRACE_MAX_ARGS_LEN];
+    for (int i = 0; i < MAX_NUM_ARGUMENTS && tokens[i] != NULL; ++i)
     {
-        printf("ERROR: Disk image not open\n");
-        return;
+        size_t len = strlen(tokens[i]) + 1;
+        memcpy(args + rec.args_len, tokens[i], len);
+        rec.args_len += len;
+        rec.num_args++;
     }
 
-    image_open = 0;
-    memset(image_name, 0, sizeof(image_name));
+    int64_t stdin_before = stdin_bytes;
+    int64_t start = now_ns();
+    rec.result = run_command(tokens);
+    rec.duration_ns = now_ns() - start;
+    rec.start_ns = start - trace_start_ns;
+
+    if (from_stdin)
+        rec.input_size = stdin_bytes - stdin_before;
+
+    fwrite(&rec, TRACE_RECORD_SIZE, 1, trace_fp);
+    fwrite(args, 1, rec.args_len, trace_fp);
 }
 
-// create a new disk image and initialize it
-void createfs(char *tokens[MAX_NUM_ARGUMENTS])
+// Where a host file the trace names lives during a replay: in the scratch
+// directory, with slashes turned into underscores
+void scratch_path(char *buf, size_t size, const char *scratch, const char *name)
 {
-    int n = strlen(tokens[1]);
-    if (n >= sizeof(image_name))
-    {
-        fprintf(stderr, "Image name too long");
-    }
+    int len = snprintf(buf, size, "%s/", scratch);
+    for (const char *c = name; *c != '\0' && len + 1 < (int)size; ++c)
+        buf[len++] = (*c == '/') ? '_' : *c;
+    buf[len] = '\0';
+}
 
-    // We do this "test run" to check if we can actually write a file
-    // with this name in this directory so the user will not be stranded
-    // later when calling `savefs`
-    FILE *fp = fopen(tokens[1], "w");
+// Make up a host file of `size' bytes. The contents only depend on `seed',
+// so every replay of a trace gets the same data
+bool synthesize(const char *path, int64_t size, uint64_t seed)
+{
+    FILE *fp = fopen(path, "w");
     if (fp == NULL)
+        return false;
+
+    uint64_t x = seed * 0x9E3779B97F4A7C15ull + 1;
+    uint64_t chunk[512];
+
+    while (size > 0)
     {
-        fprintf(stderr, "Failed to create file");
-        return;
+        for (int i = 0; i < 512; ++i)
+        {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            chunk[i] = x;
+        }
+        size_t len = size < (int64_t)sizeof(chunk) ? size : sizeof(chunk);
+        fwrite(chunk, 1, len, fp);
+        size -= len;
     }
-    fclose(fp);
-
-    init();
-    strncpy(image_name, tokens[1], n);
 
-    printf("File system image created!\n");
-    image_open = 1;
+    fclose(fp);
+    return true;
 }
 
-// saves the disk image if one is currently open
-void savefs(char *tokens[MAX_NUM_ARGUMENTS])
+// Point the host files of a recorded command at the scratch directory, so
+// that a replay never touches the files the trace was taken with. Inputs
+// that are gone, changed size or came from stdin are made up. `paths'
+// holds the strings the tokens now point to
+void replay_paths(char *tokens[MAX_NUM_ARGUMENTS], const struct trace_record *rec,
+                  const char *scratch, uint64_t seq, char paths[3][PATH_MAX])
 {
-    if (image_open == 0)
+    int input, output;
+    host_files(tokens[0], &input, &output);
+
+    int arg = input ? host_arg(tokens, input) : -1;
+    if (arg != -1 && rec->input_size >= 0)
     {
-        printf("ERROR: Disk image is not open\n");
-        return;
+        struct stat buf;
+        if (!strcmp(tokens[arg], "-") || stat(tokens[arg], &buf) == -1 ||
+            buf.st_size != rec->input_size)
+        {
+            snprintf(paths[0], PATH_MAX, "%s/input-%llu", scratch, (unsigned long long)seq);
+            if (!synthesize(paths[0], rec->input_size, seq))
+                return;
+
+            // insert names the file after its host file, unless told
+            // otherwise. The stand-in must end up under the same name
+            if (!strcmp(tokens[0], "insert"))
+            {
+                char *name = basename(tokens[arg]);
+                int dest = host_arg(tokens, 2);
+                int32_t target = -1;
+
+                if (dest != -1 && image_open)
+                    target = lookup(tokens[dest], NULL, NULL);
+
+                if (dest == -1)
+                {
+                    for (int i = arg + 1; i < MAX_NUM_ARGUMENTS; ++i)
+                    {
+                        if (tokens[i] == NULL)
+                        {
+                            tokens[i] = name;
+                            break;
+                        }
+                    }
+                }
+                else if (target != -1 && is_dir(target))
+                {
+                    snprintf(paths[2], PATH_MAX, "%s/%s", tokens[dest], name);
+                    tokens[dest] = paths[2];
+                }
+            }
+            tokens[arg] = paths[0];
+        }
     }
-    char *name = image_name;
 
-    // If they provide a new name
-    if (tokens[1] != NULL)
-        name = tokens[1];
+    // An image written during the replay is opened from the scratch copy
+    if (!strcmp(tokens[0], "open") && (arg = host_arg(tokens, 1)) != -1)
+    {
+        scratch_path(paths[1], PATH_MAX, scratch, tokens[arg]);
+        if (access(paths[1], R_OK) == 0)
+            tokens[arg] = paths[1];
+    }
 
-    FILE *fp = fopen(name, "w");
-    if (fp == NULL)
-        fprintf(stderr, "savefs: fatal error: could not open file for writing");
+    if (output == 0)
+        return;
 
-    int blocks_wrote = fwrite(curr_image, BLOCK_SIZE, NUM_BLOCKS, fp);
+    // Outputs that were left to their default get their name spelled out
+    const char *name = NULL;
+    if ((arg = host_arg(tokens, output)) != -1)
+        name = tokens[arg];
+    else if (!strcmp(tokens[0], "retrieve") && (arg = host_arg(tokens, 1)) != -1)
+        name = basename(tokens[arg]);
+    else if (!strcmp(tokens[0], "savefs") && image_open)
+        name = image_name;
+
+    // The image may already be one in the scratch directory
+    if (name == NULL || !strncmp(name, scratch, strlen(scratch)))
+        return;
 
-    if (blocks_wrote == 0 && !feof(fp))
-        fprintf(stderr, "Error, could not write disk image to file\n");
-    else
-        printf("Wrote %d blocks to %s\n", blocks_wrote, name);
+    scratch_path(paths[1], PATH_MAX, scratch, name);
+    if ((arg = host_arg(tokens, output)) != -1)
+    {
+        tokens[arg] = paths[1];
+        return;
+    }
 
-    fclose(fp);
+    for (int i = 1; i < MAX_NUM_ARGUMENTS; ++i)
+    {
+        if (tokens[i] == NULL)
+        {
+            tokens[i] = paths[1];
+            break;
+        }
+    }
 }
 
-// add and remove attributes to files in the disk image
-// options are +h,+r to add the 'hidden' and 'read-only'
-// attributes, respectively
-//-h and -r are used to remove them
-// Hidden files can only be seen when list -h is invoked
-// Read only files can not be deleted
-void attrib(char *tokens[MAX_NUM_ARGUMENTS])
+struct replay_stats
 {
-    if (!image_open)
+    uint32_t count;
+    int64_t recorded_ns;
+    int64_t replayed_ns;
+    int64_t max_ns;
+};
+
+// Run a trace again. With a `speed' of 0 commands go back to back,
+// otherwise they start at their recorded times divided by `speed'
+int replay(const char *path, double speed)
+{
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
     {
-        printf("Error: Disk Image not open.\n");
-        return;
+        fprintf(stderr, "replay: ERROR: could not open trace `%s'\n", path);
+        return 1;
     }
 
-    char *file = tokens[2];
-    if (file == NULL)
+    struct trace_header header;
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) ||
+        header.version != TRACE_VERSION)
     {
-        printf("attrib: ERROR: File name was not read.\n");
-        return;
+        fprintf(stderr, "replay: ERROR: `%s' is not a version %d trace\n", path, TRACE_VERSION);
+        fclose(fp);
+        return 1;
     }
-    uint32_t inode;
 
-    if ((inode = find_file_by_name(file, NULL)) == -1)
+    char scratch[] = "/tmp/mfs-replay-XXXXXX";
+    if (mkdtemp(scratch) == NULL)
     {
-        fprintf(stderr, "attrib: File not found\n");
-        return;
+        fprintf(stderr, "replay: ERROR: could not create a scratch directory\n");
+        fclose(fp);
+        return 1;
     }
 
-    char flag = tokens[1][0];
+    struct replay_stats stats[NUM_COMMANDS + 1];
+    memset(stats, 0, sizeof(stats));
 
-    if (flag == '-' || flag == '+')
-    {
-        bool remove = (flag == '-');
-        uint8_t mask = 0;
+    struct trace_record rec;
+    char args[TRACE_MAX_ARGS_LEN + 1];
+    char paths[3][PATH_MAX];
+    uint64_t seq = 0, mismatched = 0;
+    bool truncated = false;
 
-        char opt = tokens[1][1];
+    watch_output(true);
+    int64_t start = now_ns();
 
-        switch (opt)
+    while (fread(&rec, TRACE_RECORD_SIZE, 1, fp) == 1)
+    {
+        if (rec.args_len > TRACE_MAX_ARGS_LEN || fread(args, 1, rec.args_len, fp) != rec.args_len)
         {
-        case 'h':
-            mask = ATTRIB_HIDDEN;
+            truncated = true;
             break;
-        case 'r':
-            mask = ATTRIB_R_ONLY;
-            break;
-        case '\0':
-            fprintf(stderr, "list: ERROR: missing attribute parameter ('h' or 'r')\n");
-            break;
-        default:
-            fprintf(stderr, "list: unrecognized attribute %c\n", opt);
         }
+        args[rec.args_len] = '\0';
 
-        if (remove)
+        char *tokens[MAX_NUM_ARGUMENTS] = {NULL};
+        char *arg = args;
+        for (int i = 0; i < rec.num_args && i < MAX_NUM_ARGUMENTS && arg < args + rec.args_len; ++i)
         {
-            inodes[inode].attribute &= ~mask;
+            tokens[i] = arg;
+            arg += strlen(arg) + 1;
         }
-        else
+        if (tokens[0] == NULL)
+            continue;
+
+        replay_paths(tokens, &rec, scratch, ++seq, paths);
+
+        if (speed > 0)
         {
-            inodes[inode].attribute |= mask;
+            int64_t wait = start + (int64_t)(rec.start_ns / speed) - now_ns();
+            if (wait > 0)
+            {
+                struct timespec ts = {wait / 1000000000, wait % 1000000000};
+                nanosleep(&ts, NULL);
+            }
         }
-    }
-    else
-    {
-        fprintf(stderr, "list: ERROR: `%s' is not an attribute. Expected attribute\n", tokens[1]);
-        return;
-    }
-}
 
-// Encrypt a file using a 256 bit cypher
-void encrypt(char *tokens[MAX_NUM_ARGUMENTS])
-{
-    char *filename = tokens[1];
-    uint8_t cipher = atoi(tokens[2]) & 0xFF;
+        const command *found = find_command(tokens[0]);
+        int64_t begin = now_ns();
+        int result = run_command(tokens);
+        int64_t took = now_ns() - begin;
 
-    if (!image_open)
-    {
-        printf("Error: Disk Image not open.\n");
-        return;
+        struct replay_stats *st = &stats[found ? found - commands : NUM_COMMANDS];
+        st->count++;
+        st->recorded_ns += rec.duration_ns;
+        st->replayed_ns += took;
+        if (took > st->max_ns)
+            st->max_ns = took;
+
+        if (result != rec.result)
+            mismatched++;
     }
 
-    int32_t inode = find_file_by_name(filename, NULL);
-    if (inode == -1)
+    int64_t total = now_ns() - start;
+    fclose(fp);
+
+    fflush(stdout);
+    output_muted = false;
+
+    if (truncated)
+        printf("replay: WARNING: the trace ends in the middle of a command\n");
+
+    printf("%-10s %8s %14s %14s %12s %12s\n", "command", "count", "recorded ms", "replayed ms",
+           "mean us", "max us");
+    for (int i = 0; i <= NUM_COMMANDS; ++i)
     {
-        fprintf(stderr, "encrypt: File not found\n");
-        return;
-    }
+        struct replay_stats *st = &stats[i];
+        if (st->count == 0)
+            continue;
 
-    xor_file(inode, cipher);
-}
+        printf("%-10s %8u %14.3f %14.3f %12.1f %12.1f\n", i < NUM_COMMANDS ? commands[i].name : "(invalid)",
+               st->count, st->recorded_ns / 1e6, st->replayed_ns / 1e6,
+               st->replayed_ns / 1e3 / st->count, st->max_ns / 1e3);
+    }
 
-// Decrypt encypted cypher
-void decrypt(char *tokens[MAX_NUM_ARGUMENTS])
-{
-    // Beauty of XOR ciphers
-    encrypt(tokens);
+    printf("replay: %llu commands in %.3f ms\n", (unsigned long long)seq, total / 1e6);
+    if (mismatched)
+        printf("replay: %llu commands had a different result than when they were recorded\n",
+               (unsigned long long)mismatched);
+    printf("replay: files written during the replay are in %s\n", scratch);
+    return mismatched ? 1 : 0;
 }
 
 // Initialize the disk image with starting parameters
-// The directory takes the blocks 0-18
-// Block 19 belongs to the free inodes map
-// Blocks 20-277 are reserved for the inodes
+// Block 0 holds the superblock
+// Blocks 1-64 hold the free block map
+// Blocks 65-128 hold the inode map
+// Blocks 129-384 hold the checksum table
+// Blocks 385-448 hold the snapshot reference counts
+// Blocks 449-456 hold the snapshot table
 // The rest of the blocks are free blocks to be used by the virtual file system
+// The root directory is inode 0, created empty
 void init()
 {
-    directory = (struct directoryEntry *)&curr_image[0][0];
-    inodes = (struct inode *)&curr_image[20][0];
-    free_blocks = (uint8_t *)&curr_image[277][0];
-    free_inodes = (uint8_t *)&curr_image[19][0];
+    _Static_assert(FREE_BLOCK_MAP + NUM_BLOCKS / BLOCK_SIZE <= INODE_MAP,
+                   "free block map overlaps the inode map");
+
+    map_image();
 
     image_open = 0;
     memset(image_name, 0, 64);
 
-    // Set the first 278 blocks to in_use since they are used for metadata
+    memset(curr_image, 0, FIRST_DATA_BLOCK * BLOCK_SIZE);
+    memcpy(super->magic, FS_MAGIC, sizeof(FS_MAGIC));
+    super->version = FS_VERSION;
+
+    // Set the first FIRST_DATA_BLOCK blocks to in_use since they are used for metadata
     memset(free_blocks, 0, FIRST_DATA_BLOCK);
 
     // Set the rest of the blocks to free since we just started
     for (int i = FIRST_DATA_BLOCK; i < NUM_BLOCKS; ++i)
         free_blocks[i] = 1;
 
-    // This is the size of blocks 278-65535 in bytes
-    size_avail = 66824192;
+    // This is the size of blocks 457-65535 in bytes
+    super->size_avail = USABLE_SIZE;
 
-    for (int i = 0; i < NUM_FILES; ++i)
-    {
-        directory[i].in_use = 0;
-        directory[i].inode = -1;
-        free_inodes[i] = 1;
-        memset(directory[i].filename, 0, 64);
+    // The inode table starts out empty and grows as files are created
+    memset(inode_map, -1, MAX_INODES / INODES_PER_BLOCK * sizeof(int32_t));
 
-        for (int j = 0; j < BLOCKS_PER_FILE; ++j)
-        {
-            inodes[i].blocks[j] = -1;
-        }
-        inodes[i].in_use = 0;
-        inodes[i].attribute = 0;
-        inodes[i].file_size = 0;
-    }
+    cwd = alloc_inode(INODE_DIR, ROOT_INODE);
+    index_invalidate(-1);
 }
 
-void free_array(char **arr, size_t size)
+// Split a command line into tokens, in place. Tokens are separated by
+// whitespace. Single or double quotes keep whitespace inside a token (for
+// file names with spaces), and a backslash outside single quotes takes the
+// next character as it is. Unused slots are set to NULL. Returns the number
+// of tokens, or -1 if a quote is not closed
+int parse_tokens(char *line, char *token[MAX_NUM_ARGUMENTS])
 {
-    for (size_t i = 0; i < size; ++i)
+    int token_count = 0;
+    char *in = line;
+
+    while (token_count < MAX_NUM_ARGUMENTS)
     {
-        if (arr[i] != NULL)
+        while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')
+            in++;
+        if (*in == '\0')
+            break;
+
+        // The token is compacted over itself as quotes and backslashes go
+        char *out = in;
+        token[token_count++] = out;
+        char quote = 0;
+
+        for (; *in != '\0'; in++)
         {
-            free(arr[i]);
+            if (quote == 0 && (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r'))
+                break;
+
+            if (*in == quote)
+                quote = 0;
+            else if (quote == 0 && (*in == '"' || *in == '\''))
+                quote = *in;
+            else if (*in == '\\' && quote != '\'' && in[1] != '\0')
+                *out++ = *++in;
+            else
+                *out++ = *in;
         }
-    }
-}
 
-void parse_tokens(const char *command_string, char **token)
-{
-#define WHITESPACE " \t\n"
+        if (quote != 0)
+            return -1;
 
-    // Clean up the old values in token
-    free_array(token, MAX_NUM_ARGUMENTS);
+        // Step past the separator before it is overwritten
+        if (*in != '\0')
+            in++;
+        *out = '\0';
+    }
 
-    int token_count = 0;
-    // Pointer to point to the token parsed by strsep
-    char *argument_ptr = NULL;
+    for (int i = token_count; i < MAX_NUM_ARGUMENTS; ++i)
+        token[i] = NULL;
 
-    char *working_string = strdup(command_string);
+    return token_count;
+}
 
-    // we are going to move the working_string pointer so
-    // keep track of its original value so we can deallocate
-    // the correct amount at the end
-    char *head_ptr = working_string;
+const command *find_command(const char *name)
+{
+    int lo = 0, hi = NUM_COMMANDS - 1;
 
-    // Tokenize the input strings with whitespace used as the delimiter
-    while (((argument_ptr = strsep(&working_string, WHITESPACE)) != NULL) &&
-           (token_count < MAX_NUM_ARGUMENTS))
+    while (lo <= hi)
     {
-        token[token_count] = strndup(argument_ptr, MAX_COMMAND_SIZE);
-        if (strlen(token[token_count]) == 0)
-        {
-            free(token[token_count]);
-            token[token_count] = NULL;
-        }
-        token_count++;
-    }
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(name, commands[mid].name);
 
-    // Set all args from the last arg parsed to the end of the token array
-    // This helps so that I don't get a double free error if I run a cmd that
-    // has 7 args then run one that has 3 args then called free_array on token
-    for (; token_count < MAX_NUM_ARGUMENTS; ++token_count)
-    {
-        token[token_count] = NULL;
+        if (cmp == 0)
+            return &commands[mid];
+        if (cmp < 0)
+            hi = mid - 1;
+        else
+            lo = mid + 1;
     }
+    return NULL;
+}
 
-    free(head_ptr);
+void usage(void)
+{
+    fprintf(stderr, "usage: mfs [--trace file]\n"
+                    "       mfs --replay file [--speed N|--max]\n");
+    exit(1);
 }
 
 int main(int argc, char **argv)
 {
-    char *command_string = (char *)malloc(MAX_COMMAND_SIZE);
+    char *trace_file = NULL, *replay_file = NULL;
+    double speed = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!strcmp(argv[i], "--max"))
+            speed = 0;
+        else if (i + 1 == argc)
+            usage();
+        else if (!strcmp(argv[i], "--trace"))
+            trace_file = argv[++i];
+        else if (!strcmp(argv[i], "--replay"))
+            replay_file = argv[++i];
+        else if (!strcmp(argv[i], "--speed") && (speed = atof(argv[++i])) > 0)
+            continue;
+        else
+            usage();
+    }
+
+    if (trace_file && replay_file)
+        usage();
+
+    // Scripts can run to millions of commands, so stdin is read in large
+    // chunks. It stays a stdio stream because `write -' reads from it too
+    static char input_buffer[1 << 16];
+    setvbuf(stdin, input_buffer, _IOFBF, sizeof(input_buffer));
+
+    char command_string[MAX_COMMAND_SIZE + 1];
     char *tokens[MAX_NUM_ARGUMENTS] = {NULL};
 
+    for (int i = 1; i < NUM_COMMANDS; ++i)
+        assert(strcmp(commands[i - 1].name, commands[i].name) < 0);
+
+    crc32c_init();
+    find_bytes_init();
+
+    for (int i = 0; i < MAX_IMAGES; ++i)
+        images[i].fd = -1;
+
+    // Slot 0 holds the first image; more are allocated as they are opened
+    images[0].blocks = calloc(NUM_BLOCKS, BLOCK_SIZE);
+    if (images[0].blocks == NULL)
+    {
+        fprintf(stderr, "mfs: out of memory\n");
+        return 1;
+    }
+    curr_image = images[0].blocks;
+
     init();
 
+    if (replay_file)
+        return replay(replay_file, speed);
+    if (trace_file)
+        trace_begin(trace_file);
+
     while (1)
     {
         // Print out the msh prompt
@@ -962,50 +6489,50 @@ int main(int argc, char **argv)
 
         // Read the command from the commandline.  The
         // maximum command that will be read is MAX_COMMAND_SIZE
-        // This while command will wait here until the user
-        // inputs something since fgets returns NULL when there
-        // is no input
-        while (!fgets(command_string, MAX_COMMAND_SIZE, stdin))
-            ;
+        // This will wait here until the user inputs something,
+        // and end the session at the end of the input
+        if (!fgets(command_string, sizeof(command_string), stdin))
+            break;
 
-        // Ignore blank lines
-        if (*command_string == '\n' || command_string[0] == ' ')
+        size_t len = strlen(command_string);
+        if (len == MAX_COMMAND_SIZE && command_string[len - 1] != '\n')
         {
+            // Throw away the rest of the line
+            int c;
+            while ((c = getchar()) != EOF && c != '\n')
+                ;
+            fprintf(stderr, "mfs: ERROR: command is longer than %d characters\n",
+                    MAX_COMMAND_SIZE - 1);
             continue;
         }
 
-        parse_tokens(command_string, tokens);
+        int num_tokens = parse_tokens(command_string, tokens);
 
-        char *cmd = tokens[0];
-
-        // Quit if command is 'quit' or 'exit'
-        if (!strcmp(cmd, "quit") || !strcmp(cmd, "exit"))
+        if (num_tokens == -1)
         {
-            break;
+            fprintf(stderr, "mfs: ERROR: missing closing quote\n");
+            continue;
         }
 
-        int i;
-        for (i = 0; i < NUM_COMMANDS; ++i)
+        // Ignore blank lines
+        if (num_tokens == 0)
         {
-            if (!strcmp(cmd, commands[i].name))
-            {
-                if (tokens[commands[i].num_args] == NULL)
-                {
-                    fprintf(stderr, "%s: Not enough arguments\n", cmd);
-                    break;
-                }
-                commands[i].run(tokens);
-                break;
-            }
+            continue;
         }
 
-        if (i == NUM_COMMANDS)
+        char *cmd = tokens[0];
+
+        // Quit if command is 'quit' or 'exit'
+        if (!strcmp(cmd, "quit") || !strcmp(cmd, "exit"))
         {
-            fprintf(stderr, "mfs: Invalid command `%s'\n", cmd);
+            break;
         }
+
+        if (trace_fp)
+            trace_command(tokens);
+        else
+            run_command(tokens);
     }
 
-    free(command_string);
-    free_array(tokens, MAX_NUM_ARGUMENTS);
     return 0;
 }